@@ -2,6 +2,7 @@ import gradio as gr
 import requests
 from pathlib import Path
 import json
+import time
 
 # A client to interact with a Stable Diffusion image generation server
 class StableDiffusionClient:
@@ -31,6 +32,17 @@ class StableDiffusionClient:
         except Exception as e:
             return f"Exception: {e}"
 
+    # Poll a submitted job until it finishes
+    def wait_for_job(self, job_id, poll_interval=1.0):
+        while True:
+            response = requests.get(f"{self.server_url}/jobs/{job_id}")
+            if response.status_code != 200:
+                return {"success": False, "error": response.text}
+            job = response.json()
+            if job.get("state") in ("completed", "failed"):
+                return job
+            time.sleep(poll_interval)
+
     # Send a generation request to the server
     def generate_image(self, prompt, negative_prompt, width, height, steps, cfg_scale, seed, batch_count):
         payload = {
@@ -51,13 +63,19 @@ class StableDiffusionClient:
                 headers={"Content-Type": "application/json"}
             )
 
-            if response.status_code != 200:
+            if response.status_code not in (200, 202):
                 return f"HTTP Error: {response.status_code}\n{response.text}", None
 
             result = response.json()
             if not result.get("success"):
                 return f"Generation Error: {result}", None
 
+            # 200 means the result cache answered; 202 means the job was queued
+            if response.status_code == 202:
+                result = self.wait_for_job(result["job_id"])
+            if not result.get("success"):
+                return f"Generation Error: {result}", None
+
             filenames = result.get("filenames", [])
             images = []
             for filename in filenames:
@@ -126,8 +126,44 @@ class StableDiffusionClient:
             print(f"Request error: {e}")
             return None
 
+    def wait_for_job(self, job_id, poll_interval=1.0):
+        """Follow /jobs/{job_id}/events, falling back to polling /jobs/{job_id}"""
+        try:
+            return self.stream_job_events(job_id)
+        except Exception as e:
+            print(f"Event stream unavailable ({e}), polling instead")
+        while True:
+            response = requests.get(f"{self.server_url}/jobs/{job_id}")
+            if response.status_code != 200:
+                return {"success": False, "error": response.text}
+            job = response.json()
+            if job.get("state") in ("completed", "failed", "cancelled"):
+                return job
+            time.sleep(poll_interval)
+
+    def stream_job_events(self, job_id):
+        """Print progress from the Server-Sent Events stream and return the finished job"""
+        event = None
+        with requests.get(f"{self.server_url}/jobs/{job_id}/events", stream=True) as response:
+            response.raise_for_status()
+            for line in response.iter_lines(decode_unicode=True):
+                if line.startswith("event:"):
+                    event = line[6:].strip()
+                elif line.startswith("data:"):
+                    job = json.loads(line[5:])
+                    if event == "done":
+                        return job
+                    if job.get("state") == "running":
+                        eta = job.get("eta_ms")
+                        eta_text = f", ETA {eta / 1000:.1f}s" if eta is not None else ""
+                        print(f"  {job.get('phase')} {job.get('step')}/{job.get('steps')}{eta_text}")
+                    else:
+                        print(f"  queued at position {job.get('queue_position')}")
+        raise RuntimeError("event stream ended before the job finished")
+
     def generate_image(self, prompt, negative_prompt="", width=512, height=512, 
-                       steps=20, cfg_scale=7.0, seed=-1, batch_count=1, save_path=None):
+                       steps=20, cfg_scale=7.0, seed=-1, batch_count=1, save_path=None,
+                       max_retries=3):
         payload = {
             "prompt": prompt,
             "negative_prompt": negative_prompt,
@@ -143,14 +179,26 @@ class StableDiffusionClient:
         print(f"Prompt: {prompt}")
 
         try:
-            response = requests.post(
-                f"{self.server_url}/generate",
-                json=payload,
-                headers={"Content-Type": "application/json"}
-            )
+            for attempt in range(max_retries + 1):
+                response = requests.post(
+                    f"{self.server_url}/generate",
+                    json=payload,
+                    headers={"Content-Type": "application/json"}
+                )
+                if response.status_code != 429 or attempt == max_retries:
+                    break
+                # Server is over capacity: wait as long as it asks before retrying
+                retry_after = int(response.headers.get("Retry-After", "10"))
+                print(f"Server busy, retrying in {retry_after}s")
+                time.sleep(retry_after)
 
-            if response.status_code == 200:
+            if response.status_code in (200, 202):
                 result = response.json()
+                if response.status_code == 202 and result.get("success"):
+                    print(f"Job queued: {result['job_id']} (position {result.get('queue_position')})")
+                    result = self.wait_for_job(result["job_id"])
+                elif result.get("cached"):
+                    print(f"Served from result cache: {result['job_id']}")
                 if result.get("success"):
                     filenames = result.get("filenames")
                     if not filenames:
@@ -9,6 +9,17 @@
 #include <filesystem>
 #include <atomic>
 #include <csignal>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <functional>
+#include <unordered_map>
+#include <sstream>
+#include <cstdlib>
+#include <cstdio>
+#include <random>
+#include <algorithm>
+#include <cmath>
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
@@ -25,49 +36,684 @@
 
 #pragma message("_WIN32_WINNT=" STR(_WIN32_WINNT)) 
 
-class StableDiffusionServer {
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <cstring>
+#include <cerrno>
+// From <numaif.h>, which is only present with libnuma headers installed
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#endif
+
+// =================
+// JSON HELPERS
+// =================
+
+// Minimal reader for the flat JSON objects the clients send
+// (strings, numbers, booleans). Nested values are kept as raw text.
+class JsonObject {
 private:
-    sd_ctx_t* sd_ctx;
-    std::mutex generation_mutex;
-    bool model_loaded = false;
-    std::string model_path;
-    
+    std::unordered_map<std::string, std::string> values;
+
+    static void skip_ws(const std::string& s, size_t& i) {
+        while (i < s.size() && isspace(static_cast<unsigned char>(s[i]))) ++i;
+    }
+
+    static bool parse_string(const std::string& s, size_t& i, std::string& out) {
+        if (i >= s.size() || s[i] != '"') return false;
+        ++i;
+        out.clear();
+        while (i < s.size() && s[i] != '"') {
+            char c = s[i++];
+            if (c == '\\' && i < s.size()) {
+                char e = s[i++];
+                switch (e) {
+                    case 'n': out += '\n'; break;
+                    case 't': out += '\t'; break;
+                    case 'r': out += '\r'; break;
+                    case 'b': out += '\b'; break;
+                    case 'f': out += '\f'; break;
+                    case 'u': {
+                        if (i + 4 > s.size()) return false;
+                        unsigned cp = static_cast<unsigned>(std::stoul(s.substr(i, 4), nullptr, 16));
+                        i += 4;
+                        // Encode BMP code point as UTF-8
+                        if (cp < 0x80) {
+                            out += static_cast<char>(cp);
+                        } else if (cp < 0x800) {
+                            out += static_cast<char>(0xC0 | (cp >> 6));
+                            out += static_cast<char>(0x80 | (cp & 0x3F));
+                        } else {
+                            out += static_cast<char>(0xE0 | (cp >> 12));
+                            out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+                            out += static_cast<char>(0x80 | (cp & 0x3F));
+                        }
+                        break;
+                    }
+                    default: out += e; break;
+                }
+            } else {
+                out += c;
+            }
+        }
+        if (i >= s.size()) return false;
+        ++i;
+        return true;
+    }
+
+    // Skip any value (including nested objects/arrays) and return its raw text
+    static bool skip_value(const std::string& s, size_t& i, std::string& raw) {
+        size_t start = i;
+        int depth = 0;
+        while (i < s.size()) {
+            char c = s[i];
+            if (c == '"') {
+                std::string tmp;
+                if (!parse_string(s, i, tmp)) return false;
+                if (depth == 0) break;
+                continue;
+            }
+            if (c == '{' || c == '[') {
+                ++depth;
+            } else if (c == '}' || c == ']') {
+                if (depth == 0) break;
+                --depth;
+                if (depth == 0) { ++i; break; }
+            } else if (c == ',' && depth == 0) {
+                break;
+            }
+            ++i;
+        }
+        raw = s.substr(start, i - start);
+        while (!raw.empty() && isspace(static_cast<unsigned char>(raw.back()))) raw.pop_back();
+        return true;
+    }
+
 public:
-    StableDiffusionServer() : sd_ctx(nullptr) {}
-    
-    ~StableDiffusionServer() {
-        cleanup();
+    bool parse(const std::string& s) {
+        values.clear();
+        size_t i = 0;
+        skip_ws(s, i);
+        if (i >= s.size() || s[i] != '{') return false;
+        ++i;
+        while (true) {
+            skip_ws(s, i);
+            if (i < s.size() && s[i] == '}') return true;
+            std::string key;
+            if (!parse_string(s, i, key)) return false;
+            skip_ws(s, i);
+            if (i >= s.size() || s[i] != ':') return false;
+            ++i;
+            skip_ws(s, i);
+            std::string value;
+            if (i < s.size() && s[i] == '"') {
+                if (!parse_string(s, i, value)) return false;
+            } else if (!skip_value(s, i, value)) {
+                return false;
+            }
+            values[key] = value;
+            skip_ws(s, i);
+            if (i < s.size() && s[i] == ',') { ++i; continue; }
+            if (i < s.size() && s[i] == '}') return true;
+            return false;
+        }
     }
 
-    void cleanup() {
-        std::lock_guard<std::mutex> lock(generation_mutex);
-        if (sd_ctx) {
-            free_sd_ctx(sd_ctx);
-            sd_ctx = nullptr;
+    bool has(const std::string& key) const {
+        return values.count(key) > 0;
+    }
+
+    std::string get_string(const std::string& key, const std::string& def = "") const {
+        auto it = values.find(key);
+        return it != values.end() ? it->second : def;
+    }
+
+    int64_t get_int(const std::string& key, int64_t def = 0) const {
+        auto it = values.find(key);
+        if (it == values.end()) return def;
+        try { return static_cast<int64_t>(std::stod(it->second)); } catch (...) { return def; }
+    }
+
+    float get_float(const std::string& key, float def = 0.0f) const {
+        auto it = values.find(key);
+        if (it == values.end()) return def;
+        try { return std::stof(it->second); } catch (...) { return def; }
+    }
+
+    bool get_bool(const std::string& key, bool def = false) const {
+        auto it = values.find(key);
+        if (it == values.end()) return def;
+        return it->second == "true" || it->second == "1";
+    }
+};
+
+static std::string json_escape(const std::string& s) {
+    std::string out;
+    out.reserve(s.size() + 2);
+    for (unsigned char c : s) {
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    out += buf;
+                } else {
+                    out += static_cast<char>(c);
+                }
         }
-        model_loaded = false;
     }
+    return out;
+}
 
-    bool is_model_loaded() const {
-        return model_loaded;
+static std::string json_string_array(const std::vector<std::string>& items) {
+    std::string out = "[";
+    for (size_t i = 0; i < items.size(); ++i) {
+        if (i) out += ",";
+        out += "\"" + json_escape(items[i]) + "\"";
     }
-    
-    bool load_model(const std::string& path) {
-        std::lock_guard<std::mutex> lock(generation_mutex);
-        
-        // Free old context
+    out += "]";
+    return out;
+}
+
+// =================
+// GENERATION JOBS
+// =================
+
+struct ModelInstance;
+
+struct GenerationParams {
+    std::shared_ptr<ModelInstance> model;  // pinned at submit, released when the job finishes
+    std::string model_path;  // named model to load on demand when none was resident at submit
+    std::string prompt;
+    std::string negative_prompt;
+    int width = 512;
+    int height = 512;
+    int steps = 20;
+    float cfg_scale = 7.0f;
+    int seed = -1;
+    int batch_count = 1;
+    int priority = 0;  // higher runs first
+    int png_compression = 8;  // deflate level of the saved PNGs, 5-9 (stb_image_write raises lower levels to 5)
+
+    // Admission cost in pixel-steps; sampling time scales roughly linearly with it
+    double cost() const {
+        return static_cast<double>(width) * height * steps * batch_count;
+    }
+};
+
+// One encoded output image; filename is empty when the image failed
+struct GeneratedImage {
+    std::string filename;
+    std::shared_ptr<const std::string> png;
+};
+
+// Sampler output not yet encoded to PNG; owns the pixel buffer
+struct RawImage {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t channel = 0;
+    int png_compression = 8;
+    std::unique_ptr<uint8_t, void (*)(void*)> data{nullptr, free};
+};
+
+struct GenerationResult {
+    std::string model_id;                // identity of the model that produced the images
+    std::vector<GeneratedImage> images;  // one entry per requested image
+    std::vector<RawImage> raw;           // index-aligned with images until encoded
+};
+
+enum class JobState {
+    QUEUED,
+    RUNNING,
+    COMPLETED,
+    FAILED,
+    CANCELLED
+};
+
+static const char* job_state_to_string(JobState state) {
+    switch (state) {
+        case JobState::QUEUED:    return "queued";
+        case JobState::RUNNING:   return "running";
+        case JobState::COMPLETED: return "completed";
+        case JobState::FAILED:    return "failed";
+        case JobState::CANCELLED: return "cancelled";
+    }
+    return "unknown";
+}
+
+struct GenerationJob {
+    std::string id;
+    std::string client;           // remote address, for per-client budgets
+    std::string model_path;       // model the job was submitted against
+    GenerationParams params;
+    JobState state = JobState::QUEUED;
+    int64_t seed_used = -1;       // first seed of this job's images
+    int batched_with = 0;         // other jobs sharing the same txt2img call
+    std::atomic<bool> cancel_requested{false};
+    uint64_t version = 0;         // bumped on every state or progress change
+    bool cost_reserved = false;   // counted against the admission budget
+    bool from_cache = false;      // served from the result cache without sampling
+
+    // Identical deterministic jobs collapse onto one leader and share its result
+    std::string dedup_key;
+    std::string collapsed_into;           // id of the leader, for followers
+    std::weak_ptr<GenerationJob> leader;
+    std::vector<std::shared_ptr<GenerationJob>> followers;
+
+    // Sampling progress, reported by the step callback. The sampler runs
+    // once per image of the txt2img call, so steps count over all of them.
+    int step = 0;
+    int total_steps = 0;
+    int image = 0;                // image of the call being sampled
+    int image_step = 0;           // last step reported for that image
+    bool decoding = false;        // steps refer to VAE tiles, not sampling
+    bool encoding = false;        // sampling done, images are being written
+    float step_time_sum = 0.0f;   // seconds over `step_samples` sampling steps
+    int step_samples = 0;
+    std::vector<std::string> filenames;
+    std::string error;
+    std::chrono::steady_clock::time_point submitted_at;
+    std::chrono::steady_clock::time_point started_at;
+    std::chrono::steady_clock::time_point finished_at;
+};
+
+// Separate component files for models split across files (SD3, Flux).
+// The model path is then the diffusion model.
+struct ModelComponents {
+    std::string clip_l;
+    std::string clip_g;
+    std::string t5xxl;
+    std::string vae;
+
+    bool empty() const {
+        return clip_l.empty() && clip_g.empty() && t5xxl.empty() && vae.empty();
+    }
+};
+
+// A loaded model. Queued and running jobs hold a shared_ptr to the
+// instance they were submitted against, so a model swapped out by
+// load_model stays resident until its last job has finished.
+struct ModelInstance {
+    std::string path;
+    std::string weights_path;  // file actually loaded: path or its converted GGUF cache
+    ModelComponents components;  // kept so an evicted split model reloads complete
+    std::string identity;  // path, size and mtime of every weight file; keys cached results
+    std::vector<std::pair<std::string, int64_t>> convert_ms;  // weight cache conversions of this load
+    size_t bytes = 0;      // estimated resident size, counted against the model budget
+    std::chrono::steady_clock::time_point last_used;
+    sd_ctx_t* sd_ctx = nullptr;
+
+    ~ModelInstance() {
         if (sd_ctx) {
             free_sd_ctx(sd_ctx);
-            sd_ctx = nullptr;
+            std::cout << "Model unloaded: " << path << std::endl;
         }
-        
+    }
+};
+
+// A (width, height, batch_count) shape run once ahead of traffic
+struct WarmupBucket {
+    int width = 512;
+    int height = 512;
+    int batch_count = 1;
+};
+
+// Parse "512x512,768x768x2": width x height, optionally x batch_count
+static bool parse_warmup_buckets(const std::string& spec, std::vector<WarmupBucket>& buckets) {
+    std::stringstream list(spec);
+    std::string item;
+    while (std::getline(list, item, ',')) {
+        WarmupBucket bucket;
+        int fields = std::sscanf(item.c_str(), " %dx%dx%d", &bucket.width, &bucket.height, &bucket.batch_count);
+        if (fields < 2 || bucket.width <= 0 || bucket.height <= 0 || bucket.width % 8 ||
+            bucket.height % 8 || bucket.batch_count <= 0) {
+            return false;
+        }
+        buckets.push_back(bucket);
+    }
+    return !buckets.empty();
+}
+
+struct WarmupResult {
+    WarmupBucket bucket;
+    int64_t ms = 0;
+    bool ok = false;
+};
+
+// Threads deflating PNG row bands, shared by all encoder threads, so that
+// concurrent encodes queue their bands instead of each starting threads.
+// The encoding thread works through its own bands as well: the pool only
+// adds helpers, and an image never waits for another image's bands.
+class PngBandPool {
+    // One image's bands, claimed one at a time by whichever thread is free
+    struct Run {
+        void (*task)(void*, int) = nullptr;
+        void* arg = nullptr;
+        int count = 0;
+        std::atomic<int> next{0};
+        int done = 0;  // guarded by mutex
+        std::mutex mutex;
+        std::condition_variable finished;
+
+        void work() {
+            int ran = 0;
+            for (int i; (i = next++) < count; ++ran) {
+                task(arg, i);
+            }
+            if (ran > 0) {
+                std::lock_guard<std::mutex> lock(mutex);
+                done += ran;
+                if (done == count) {
+                    finished.notify_all();
+                }
+            }
+        }
+    };
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::shared_ptr<Run>> runs;  // guarded by mutex
+    bool stopping = false;                  // guarded by mutex
+    std::vector<std::thread> threads;
+
+    void loop() {
+        while (true) {
+            std::shared_ptr<Run> run;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this] { return stopping || !runs.empty(); });
+                if (runs.empty()) {
+                    return;
+                }
+                run = std::move(runs.front());
+                runs.pop_front();
+            }
+            run->work();
+        }
+    }
+
+public:
+    explicit PngBandPool(int helpers) {
+        for (int i = 0; i < helpers; ++i) {
+            threads.emplace_back(&PngBandPool::loop, this);
+        }
+    }
+
+    ~PngBandPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    // stbi_write_png_options::parallel_for, with the pool as parallel_context
+    static void parallel_for(void* context, int count, void (*task)(void*, int), void* arg) {
+        static_cast<PngBandPool*>(context)->run(count, task, arg);
+    }
+
+    void run(int count, void (*task)(void*, int), void* arg) {
+        auto bands = std::make_shared<Run>();
+        bands->task = task;
+        bands->arg = arg;
+        bands->count = count;
+        int helpers = std::min(count - 1, static_cast<int>(threads.size()));
+        if (helpers > 0) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                runs.insert(runs.end(), helpers, bands);
+            }
+            cv.notify_all();
+        }
+        bands->work();
+        std::unique_lock<std::mutex> lock(bands->mutex);
+        bands->finished.wait(lock, [&] { return bands->done == count; });
+    }
+};
+
+// One generation context per loaded model. The library cannot share
+// weights between contexts, so generations are scaled through this
+// context's ggml thread budget rather than through more contexts, each of
+// which would hold its own copy of the weights.
+//
+// Several models stay resident up to a memory budget. Requests name the
+// model they need; a missing one is loaded on demand after evicting the
+// least recently used idle models. The default model (the last one loaded
+// through load_model) and models pinned by queued or running jobs are
+// never evicted.
+class StableDiffusionServer {
+private:
+    int n_threads;
+    std::mutex generation_mutex;  // serializes txt2img calls
+    std::shared_ptr<ModelInstance> current_model;  // default for requests naming no model
+    std::list<std::shared_ptr<ModelInstance>> resident;  // most recently used first
+    std::mutex model_mutex;  // guards the fields below; never held during generation or loading
+    std::condition_variable load_cv;  // signalled when a load finishes
+    std::string loading_path;  // non-empty while a load runs; only one load at a time
+    std::string last_load_error;
+    std::thread load_thread;
+    std::function<void()> thread_init;  // CPU placement of threads that open contexts
+    std::string models_dir;
+    std::unordered_map<std::string, ModelComponents> component_specs;  // split models by path, for reloads
+    size_t memory_budget = 0;  // bytes; 0 keeps only the default model and the ones in use
+    uint64_t model_loads = 0;
+    uint64_t model_evictions = 0;
+    uint64_t model_swaps = 0;  // loads triggered by a job needing a non-resident model
+    std::vector<WarmupResult> last_warmup;
+    int64_t load_ms_total = 0; // time spent loading, including failed loads
+    sd_type_t weight_type = SD_TYPE_F16;
+    int convert_threads = 0;  // parallel weight cache conversions of a split model; 0 = one per file
+
+    // Converted weights are persisted as GGUF so later loads skip the conversion
+    bool weight_cache_enabled = true;
+    std::string weight_cache_dir;  // empty: next to the source file
+    uint64_t weight_cache_hits = 0;
+    uint64_t weight_cache_rehashes = 0;  // sources whose mtime changed but content did not
+    uint64_t weight_conversions = 0;
+    int64_t convert_ms_total = 0;
+
+    // Cold start, measured from process start
+    std::chrono::steady_clock::time_point process_started = std::chrono::steady_clock::now();
+    int64_t startup_ready_ms = -1;        // initial model loaded and warmed up
+    int64_t startup_first_image_ms = -1;  // first generated image written
+
+    // FNV-1a over `len` bytes of `file` starting at `offset`
+    static uint64_t hash_range(std::ifstream& file, uint64_t offset, uint64_t len, uint64_t hash) {
+        std::vector<char> buffer(1 << 20);
+        file.clear();
+        file.seekg(static_cast<std::streamoff>(offset));
+        while (len > 0 && file) {
+            file.read(buffer.data(), static_cast<std::streamsize>(std::min<uint64_t>(len, buffer.size())));
+            size_t got = static_cast<size_t>(file.gcount());
+            for (size_t i = 0; i < got; ++i) {
+                hash = (hash ^ static_cast<unsigned char>(buffer[i])) * 1099511628211ULL;
+            }
+            len -= std::min<uint64_t>(len, got);
+            if (got == 0) {
+                break;
+            }
+        }
+        return hash;
+    }
+
+    // Names the cache file: size plus the first and last MiB, enough to tell
+    // different checkpoints with the same stem apart without reading them
+    static uint64_t sample_hash(const std::string& path, uint64_t size) {
+        const uint64_t window = 1 << 20;
+        std::ifstream file(path, std::ios::binary);
+        uint64_t hash = 1469598103934665603ULL ^ size;
+        hash = hash_range(file, 0, std::min(size, window), hash);
+        if (size > window) {
+            hash = hash_range(file, std::max(size - window, window), window, hash);
+        }
+        return hash;
+    }
+
+    // Hash of the whole source, stored beside the cache when it is written
+    static uint64_t content_hash(const std::string& path, uint64_t size) {
+        std::ifstream file(path, std::ios::binary);
+        return hash_range(file, 0, size, 1469598103934665603ULL);
+    }
+
+    // The sidecar next to a cached GGUF records the source it was converted
+    // from as "<size> <mtime> <content hash>"
+    static bool read_sidecar(const std::filesystem::path& sidecar,
+                             uint64_t& size, int64_t& mtime, uint64_t& hash) {
+        std::ifstream file(sidecar);
+        return static_cast<bool>(file >> size >> mtime >> std::hex >> hash);
+    }
+
+    static bool write_sidecar(const std::filesystem::path& sidecar,
+                              uint64_t size, int64_t mtime, uint64_t hash) {
+        std::filesystem::path partial = sidecar;
+        partial += ".partial";
+        {
+            std::ofstream file(partial, std::ios::trunc);
+            file << size << " " << mtime << " " << std::hex << hash << "\n";
+            if (!file) {
+                return false;
+            }
+        }
+        std::error_code ec;
+        std::filesystem::rename(partial, sidecar, ec);
+        return !ec;
+    }
+
+    // The GGUF holding `path` converted to weight_type, written on first use.
+    // A cache is used when its sidecar matches the source's size and mtime;
+    // if only the mtime moved (copied or touched file) the source is hashed
+    // once more and compared with the hash taken at conversion time. Falls
+    // back to the source when it is already GGUF or conversion fails.
+    std::string cached_weights(const std::string& path, int64_t* convert_ms = nullptr) {
+        std::filesystem::path source(path);
+        std::string ext = source.extension().string();
+        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+        if (!weight_cache_enabled || ext == ".gguf") {
+            return path;
+        }
+
+        std::error_code ec;
+        uint64_t size = std::filesystem::file_size(path, ec);
+        int64_t mtime = std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+        if (ec) {
+            return path;
+        }
+        char key[17];
+        snprintf(key, sizeof(key), "%016llx", static_cast<unsigned long long>(sample_hash(path, size)));
+        std::filesystem::path dir = weight_cache_dir.empty() ? source.parent_path()
+                                                             : std::filesystem::path(weight_cache_dir);
+        std::filesystem::path cached = dir / (source.stem().string() + "." + key + "." +
+                                              sd_type_name(weight_type) + ".gguf");
+        std::filesystem::path sidecar = cached;
+        sidecar += ".source";
+
+        uint64_t cached_size = 0;
+        int64_t cached_mtime = 0;
+        uint64_t cached_hash = 0;
+        uint64_t hash = 0;
+        bool have_hash = false;
+        if (std::filesystem::is_regular_file(cached, ec) &&
+            read_sidecar(sidecar, cached_size, cached_mtime, cached_hash) && cached_size == size) {
+            bool fresh = cached_mtime == mtime;
+            if (!fresh) {
+                hash = content_hash(path, size);
+                have_hash = true;
+                fresh = hash == cached_hash;
+                if (fresh) {
+                    write_sidecar(sidecar, size, mtime, hash);
+                }
+            }
+            if (fresh) {
+                std::lock_guard<std::mutex> lock(model_mutex);
+                weight_cache_hits++;
+                weight_cache_rehashes += have_hash ? 1 : 0;
+                return cached.string();
+            }
+        }
+
+        // Convert into a temporary name so a crash never leaves a truncated cache file
+        std::cout << "Converting " << path << " to " << sd_type_name(weight_type)
+                  << ": " << cached.string() << std::endl;
+        auto started = std::chrono::steady_clock::now();
+        std::filesystem::path partial = cached;
+        partial += ".partial";
+        bool ok = convert(path.c_str(), "", partial.string().c_str(), weight_type);
+        if (ok) {
+            std::filesystem::remove(sidecar, ec);
+            std::filesystem::rename(partial, cached, ec);
+            ok = !ec && write_sidecar(sidecar, size, mtime, have_hash ? hash : content_hash(path, size));
+        }
+        auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                              std::chrono::steady_clock::now() - started).count();
+        if (!ok) {
+            std::filesystem::remove(partial, ec);
+            std::cout << "Weight cache conversion failed, loading " << path << " directly" << std::endl;
+            return path;
+        }
+        if (convert_ms) {
+            *convert_ms = elapsed_ms;
+        }
+        std::lock_guard<std::mutex> lock(model_mutex);
+        weight_conversions++;
+        convert_ms_total += elapsed_ms;
+        return cached.string();
+    }
+
+    // Build a complete model instance without touching the one being served
+    std::shared_ptr<ModelInstance> create_instance(const std::string& path,
+                                                   const ModelComponents& components) {
+        const char* names[] = {"model", "clip_l", "clip_g", "t5xxl", "vae"};
+        std::vector<std::string> sources = {path, components.clip_l, components.clip_g,
+                                            components.t5xxl, components.vae};
+        std::vector<std::string> weights(sources.size());
+        std::vector<int64_t> convert_ms(sources.size(), -1);
+
+        // First-time weight cache conversions of the files run on a bounded
+        // pool; the library itself then reads the files one after another
+        std::atomic<size_t> next_part{0};
+        auto convert_parts = [&] {
+            for (size_t i; (i = next_part++) < sources.size();) {
+                if (!sources[i].empty()) {
+                    weights[i] = cached_weights(sources[i], &convert_ms[i]);
+                }
+            }
+        };
+        size_t files = sources.size() - std::count(sources.begin(), sources.end(), std::string());
+        size_t pool_size = std::min(files, convert_threads > 0 ? static_cast<size_t>(convert_threads) : files);
+        std::vector<std::thread> pool;
+        for (size_t i = 1; i < pool_size; ++i) {
+            pool.emplace_back([&] {
+                if (thread_init) {
+                    thread_init();
+                }
+                convert_parts();
+            });
+        }
+        convert_parts();
+        for (auto& thread : pool) {
+            thread.join();
+        }
+
+        // A split model names its diffusion model in diffusion_model_path
+        bool split = !components.empty();
         // Model parmaters
-        sd_ctx = new_sd_ctx(path.c_str(),     // model_path
-                            "",               // clip_l_path
-                            "",               // clip_g_path
-                            "",               // t5xxl_path
-                            "",               // diffusion_model_path
-                            "",               // vae_path
+        sd_ctx_t* sd_ctx = new_sd_ctx(split ? "" : weights[0].c_str(),  // model_path
+                            weights[1].c_str(),  // clip_l_path
+                            weights[2].c_str(),  // clip_g_path
+                            weights[3].c_str(),  // t5xxl_path
+                            split ? weights[0].c_str() : "",  // diffusion_model_path
+                            weights[4].c_str(),  // vae_path
                             "",               // taesd_path
                             "",               // control_net_path
                             "",               // lora_model_dir
@@ -76,8 +722,8 @@ public:
                             false,            // vae_decode_only
                             true,             // vae_tiling
                             false,             // free_params_immediately unload weights after generation
-                            6,                // n_threads
-                            SD_TYPE_F16,      // wtype
+                            n_threads,        // n_threads
+                            weight_type,      // wtype
                             STD_DEFAULT_RNG,  // RNG без CUDA
                             KARRAS,           // schedule
                             false,            // keep_clip_on_cpu
@@ -85,130 +731,705 @@ public:
                             false,            // keep_vae_on_cpu
                             false             // diffusion_flash_attn
         );
-        
-        model_loaded = (sd_ctx != nullptr);
-        if (model_loaded) {
-            model_path = path;
-            std::cout << "Model loaded successfully: " << path << std::endl;
-        } else {
-            std::cout << "Failed to load model: " << path << std::endl;
+        if (!sd_ctx) {
+            return nullptr;
         }
-        
-        return model_loaded;
+        auto instance = std::make_shared<ModelInstance>();
+        instance->path = path;
+        instance->weights_path = weights[0];
+        instance->components = components;
+        instance->identity = file_identity(path);
+        for (size_t i = 0; i < sources.size(); ++i) {
+            if (sources[i].empty()) {
+                continue;
+            }
+            if (i > 0) {
+                instance->identity += "|" + file_identity(sources[i]);
+            }
+            instance->bytes += estimate_bytes(weights[i]);
+            if (convert_ms[i] >= 0) {
+                instance->convert_ms.emplace_back(names[i], convert_ms[i]);
+            }
+        }
+        instance->sd_ctx = sd_ctx;
+        return instance;
     }
 
-
-std::vector<std::string> generate_image(const std::string& prompt,
-                                        const std::string& negative_prompt = "",
-                                        int width = 512,
-                                        int height = 512,
-                                        int steps = 20,
-                                        float cfg_scale = 7.0f,
-                                        int seed = -1,
-                                        int batch_count = 1) {
-    std::lock_guard<std::mutex> lock(generation_mutex);
-    std::vector<std::string> filenames;
-
-    if (!model_loaded || !sd_ctx) {
-        std::cout << "Model not loaded or context is null" << std::endl;
-        return filenames;
+    // The converted weights are not exposed by the library; the file size is
+    // close for F16 checkpoints and an upper bound for F32 ones
+    static size_t estimate_bytes(const std::string& path) {
+        std::error_code ec;
+        auto size = std::filesystem::file_size(path, ec);
+        return ec ? 0 : static_cast<size_t>(size);
     }
 
-    auto now = std::chrono::system_clock::now();
-    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count();
-
-    std::cout << "Starting generation with prompt: " << prompt << std::endl;
+    // Called with model_mutex held
+    std::shared_ptr<ModelInstance> find_resident(const std::string& path) {
+        for (auto it = resident.begin(); it != resident.end(); ++it) {
+            if ((*it)->path == path) {
+                auto instance = *it;
+                instance->last_used = std::chrono::steady_clock::now();
+                resident.splice(resident.begin(), resident, it);
+                return instance;
+            }
+        }
+        return nullptr;
+    }
 
-    sd_image_t* results = nullptr;
+    // Drop least recently used idle models until `incoming` more bytes fit the
+    // budget. The default model, `keep` and models referenced outside the
+    // resident list (pinned by queued or running jobs) stay. Called with
+    // model_mutex held; the returned models must be released after
+    // unlocking, since freeing a context is slow.
+    std::vector<std::shared_ptr<ModelInstance>> evict_for(size_t incoming, const ModelInstance* keep) {
+        size_t total = incoming;
+        for (auto& instance : resident) {
+            total += instance->bytes;
+        }
+        std::vector<std::shared_ptr<ModelInstance>> evicted;
+        for (auto it = resident.end(); it != resident.begin() && total > memory_budget;) {
+            --it;
+            auto& instance = *it;
+            if (instance == current_model || instance.get() == keep || instance.use_count() > 1) {
+                continue;
+            }
+            std::cout << "Evicting model: " << instance->path << std::endl;
+            total -= instance->bytes;
+            evicted.push_back(std::move(instance));
+            it = resident.erase(it);
+            model_evictions++;
+        }
+        return evicted;
+    }
 
-    try {
-        results = txt2img(sd_ctx,
-                          prompt.c_str(),
-                          negative_prompt.c_str(),
-                          -1,
-                          cfg_scale,
-                          1.0f,
-                          0.0f,
-                          width,
-                          height,
-                          EULER_A,
-                          steps,
-                          static_cast<int64_t>(seed),
-                          batch_count,
-                          nullptr,
-                          0.0f,
-                          0.0f,
-                          false,
-                          "",
-                          nullptr,
-                          0,
-                          0.0f,
-                          0.0f,
-                          1.0f);
+    // Claim the single loading slot
+    bool reserve_load(const std::string& path) {
+        std::lock_guard<std::mutex> lock(model_mutex);
+        if (!loading_path.empty()) {
+            std::cout << "Another model load is in progress, ignoring: " << path << std::endl;
+            return false;
+        }
+        loading_path = path;
+        return true;
+    }
 
-        if (!results) {
-            std::cout << "txt2img returned null" << std::endl;
-            return filenames;
+    // Opens the context on a thread that ran thread_init, so the weights
+    // are first touched under the generation placement
+    bool load_placed(const std::string& path, const ModelComponents& components) {
+        if (!thread_init) {
+            return load_reserved(path, components);
         }
+        bool loaded = false;
+        std::thread loader([this, &path, &components, &loaded] {
+            thread_init();
+            loaded = load_reserved(path, components);
+        });
+        loader.join();
+        return loaded;
+    }
 
-        for (int i = 0; i < batch_count; ++i) {
-            if (!results[i].data) {
-                std::cout << "Image " << i << " is null, skipping" << std::endl;
-                continue;
+    // Empty `components` reuse the ones `path` was last loaded with, so a
+    // split model evicted under the budget reloads with all of its files
+    bool load_reserved(const std::string& path, ModelComponents components = {},
+                       bool make_default = true) {
+        auto started = std::chrono::steady_clock::now();
+        std::shared_ptr<ModelInstance> instance;
+        std::vector<std::shared_ptr<ModelInstance>> evicted;
+        {
+            std::lock_guard<std::mutex> lock(model_mutex);
+            auto spec = component_specs.find(path);
+            if (components.empty() && spec != component_specs.end()) {
+                components = spec->second;
             }
-
-            std::string filename = "generated_" + std::to_string(ms + i) + ".png";
-            int result = stbi_write_png(filename.c_str(),
-                                        results[i].width,
-                                        results[i].height,
-                                        results[i].channel,
-                                        results[i].data,
-                                        results[i].width * results[i].channel);
-
-            if (result) {
-                filenames.push_back(filename);
-                std::cout << "Saved: " << filename << std::endl;
-            } else {
-                std::cout << "Failed to save image: " << i << std::endl;
+            // Make room first so the old and new weights are not both in RAM
+            size_t incoming = estimate_bytes(path);
+            for (const std::string* part : {&components.clip_l, &components.clip_g,
+                                            &components.t5xxl, &components.vae}) {
+                incoming += part->empty() ? 0 : estimate_bytes(*part);
             }
+            evicted = evict_for(incoming, nullptr);
+        }
+        evicted.clear();
+        try {
+            instance = create_instance(path, components);
+        } catch (const std::exception& e) {
+            std::cout << "Exception while loading model: " << e.what() << std::endl;
         }
+        auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                              std::chrono::steady_clock::now() - started).count();
 
-        // Memory free
-        for (int i = 0; i < batch_count; ++i) {
-            if (results[i].data) {
-                free(results[i].data);
-                results[i].data = nullptr;
+        std::shared_ptr<ModelInstance> previous;
+        bool serving = false;
+        {
+            std::lock_guard<std::mutex> lock(model_mutex);
+            loading_path.clear();
+            serving = current_model != nullptr;
+            load_ms_total += elapsed_ms;
+            if (!make_default) {
+                model_swaps++;
+            }
+            if (instance) {
+                // A reload of a resident path replaces that instance; jobs
+                // pinned to the old one still finish on it
+                for (auto it = resident.begin(); it != resident.end(); ++it) {
+                    if ((*it)->path == path) {
+                        previous = std::move(*it);
+                        resident.erase(it);
+                        break;
+                    }
+                }
+                instance->last_used = std::chrono::steady_clock::now();
+                resident.push_front(instance);
+                if (make_default || !current_model) {
+                    current_model = instance;
+                }
+                model_loads++;
+                if (!components.empty()) {
+                    component_specs[path] = components;
+                }
+                evicted = evict_for(0, instance.get());
+                last_load_error.clear();
+            } else {
+                last_load_error = "Failed to load model: " + path;
             }
         }
-        free(results);
-        results = nullptr;
+        load_cv.notify_all();
 
-    } catch (const std::exception& e) {
-        std::cout << "Exception during generation: " << e.what() << std::endl;
-    } catch (...) {
-        std::cout << "Unknown exception during generation" << std::endl;
+        if (instance) {
+            std::cout << "Model loaded successfully: " << path << " (" << elapsed_ms << " ms)" << std::endl;
+        } else {
+            std::cout << "Failed to load model: " << path
+                      << (serving ? ", keeping the current model" : "") << std::endl;
+        }
+        // `previous` and `evicted` are released here; jobs pinned to them
+        // keep their own reference
+        return instance != nullptr;
     }
 
-    std::cout << "Generation completed" << std::endl;
-    return filenames;
-}
-
+    // Models that went idle since the last load (their last pinned job has
+    // finished) are trimmed back to the budget
+    void release_idle_models(const ModelInstance* keep) {
+        std::vector<std::shared_ptr<ModelInstance>> evicted;
+        {
+            std::lock_guard<std::mutex> lock(model_mutex);
+            evicted = evict_for(0, keep);
+        }
+    }
     
-    std::string generate_image_old(const std::string& prompt, 
-                              const std::string& negative_prompt = "",
-                              int width = 512, 
+public:
+    explicit StableDiffusionServer(int n_threads = 6) : n_threads(std::max(1, n_threads)) {}
+    
+    ~StableDiffusionServer() {
+        if (load_thread.joinable()) {
+            load_thread.join();
+        }
+        cleanup();
+    }
+
+    void cleanup() {
+        std::lock_guard<std::mutex> lock(model_mutex);
+        current_model.reset();
+        resident.clear();
+    }
+
+    void set_weight_type(sd_type_t type) {
+        weight_type = type;
+    }
+
+    // `enabled` false loads sources directly; `dir` empty stores caches next to the source
+    void set_weight_cache(bool enabled, const std::string& dir) {
+        weight_cache_enabled = enabled;
+        weight_cache_dir = dir;
+    }
+
+    // Weight cache conversions of a split model run in parallel; 0 = one thread per file
+    void set_convert_threads(int n) {
+        convert_threads = std::max(0, n);
+    }
+
+    void set_memory_budget(size_t bytes) {
+        std::lock_guard<std::mutex> lock(model_mutex);
+        memory_budget = bytes;
+    }
+
+    // Directory in which request model names are looked up
+    void set_models_dir(const std::string& dir) {
+        models_dir = dir;
+    }
+
+    // Map a model name from a request to a file in the models directory,
+    // with or without its extension. Names are bare file names: separators,
+    // ".." and absolute paths are refused, and so is a file whose canonical
+    // path (after symlinks) leaves the directory. An empty name resolves to
+    // an empty path; false means there is no such model.
+    bool resolve_model(const std::string& name, std::string& path) const {
+        path.clear();
+        if (name.empty()) {
+            return true;
+        }
+        if (models_dir.empty() || name.find_first_of(std::string("/\\:\0", 4)) != std::string::npos ||
+            name.find("..") != std::string::npos) {
+            return false;
+        }
+        std::error_code ec;
+        std::filesystem::path root = std::filesystem::canonical(models_dir, ec);
+        if (ec) {
+            return false;
+        }
+        for (const char* ext : {"", ".gguf", ".safetensors", ".ckpt"}) {
+            std::filesystem::path candidate = std::filesystem::canonical(root / (name + ext), ec);
+            if (ec || !std::filesystem::is_regular_file(candidate, ec)) {
+                continue;
+            }
+            std::filesystem::path relative = candidate.lexically_relative(root);
+            if (relative.empty() || *relative.begin() == "..") {
+                continue;
+            }
+            path = candidate.string();
+            return true;
+        }
+        return false;
+    }
+
+    // Cheap stand-in for a content hash: a changed file changes size or mtime
+    static std::string file_identity(const std::string& path) {
+        std::error_code ec;
+        auto size = std::filesystem::file_size(path, ec);
+        auto mtime = std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+        return path + "|" + std::to_string(ec ? 0 : size) + "|" + std::to_string(ec ? 0 : mtime);
+    }
+
+    int get_threads() const {
+        return n_threads;
+    }
+
+    // Runs first on every thread that loads a model
+    void set_thread_init(std::function<void()> init) {
+        thread_init = std::move(init);
+    }
+
+    // The model new jobs are pinned to; nullptr when none is loaded
+    std::shared_ptr<ModelInstance> acquire_model() {
+        std::lock_guard<std::mutex> lock(model_mutex);
+        if (current_model) {
+            current_model->last_used = std::chrono::steady_clock::now();
+        }
+        return current_model;
+    }
+
+    // True when a job for this model can start without loading weights
+    bool is_model_ready(const std::string& path) {
+        std::lock_guard<std::mutex> lock(model_mutex);
+        if (path.empty()) {
+            return current_model != nullptr;
+        }
+        if (loading_path == path) {
+            return true;
+        }
+        for (auto& instance : resident) {
+            if (instance->path == path) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // The named model if it is resident, without loading it
+    std::shared_ptr<ModelInstance> resident_model(const std::string& path) {
+        std::lock_guard<std::mutex> lock(model_mutex);
+        return find_resident(path);
+    }
+
+    // The named model, loading it first on the calling thread if it is not
+    // resident
+    std::shared_ptr<ModelInstance> acquire_model(const std::string& path) {
+        if (path.empty()) {
+            return acquire_model();
+        }
+        std::unique_lock<std::mutex> lock(model_mutex);
+        while (true) {
+            if (auto instance = find_resident(path)) {
+                return instance;
+            }
+            if (loading_path.empty()) {
+                break;
+            }
+            load_cv.wait(lock);
+        }
+        loading_path = path;
+        lock.unlock();
+        load_reserved(path, {}, false);
+        lock.lock();
+        return find_resident(path);
+    }
+
+    std::string models_to_json() {
+        std::lock_guard<std::mutex> lock(model_mutex);
+        auto now = std::chrono::steady_clock::now();
+        size_t total = 0;
+        std::ostringstream list;
+        for (auto& instance : resident) {
+            total += instance->bytes;
+            list << (list.tellp() > 0 ? "," : "")
+                 << "{\"path\":\"" << json_escape(instance->path) << "\""
+                 << ",\"weights\":\"" << json_escape(instance->weights_path) << "\""
+                 << ",\"mb\":" << instance->bytes / (1024 * 1024)
+                 << ",\"default\":" << (instance == current_model ? "true" : "false")
+                 << ",\"in_use\":" << (instance.use_count() > (instance == current_model ? 2 : 1)
+                                          ? "true" : "false")
+                 << ",\"idle_ms\":" << std::chrono::duration_cast<std::chrono::milliseconds>(
+                                           now - instance->last_used).count();
+            if (!instance->components.empty()) {
+                list << ",\"components\":{\"clip_l\":\"" << json_escape(instance->components.clip_l) << "\""
+                     << ",\"clip_g\":\"" << json_escape(instance->components.clip_g) << "\""
+                     << ",\"t5xxl\":\"" << json_escape(instance->components.t5xxl) << "\""
+                     << ",\"vae\":\"" << json_escape(instance->components.vae) << "\"}";
+            }
+            if (!instance->convert_ms.empty()) {
+                list << ",\"convert_ms\":{";
+                for (size_t i = 0; i < instance->convert_ms.size(); ++i) {
+                    list << (i ? "," : "") << "\"" << instance->convert_ms[i].first
+                         << "\":" << instance->convert_ms[i].second;
+                }
+                list << "}";
+            }
+            list << "}";
+        }
+        std::ostringstream out;
+        out << "{\"budget_mb\":" << memory_budget / (1024 * 1024)
+            << ",\"resident_mb\":" << total / (1024 * 1024)
+            << ",\"loads\":" << model_loads
+            << ",\"swaps\":" << model_swaps
+            << ",\"load_ms\":" << load_ms_total
+            << ",\"evictions\":" << model_evictions
+            << ",\"weight_type\":\"" << sd_type_name(weight_type) << "\""
+            << ",\"weight_cache\":{\"enabled\":" << (weight_cache_enabled ? "true" : "false")
+            << ",\"hits\":" << weight_cache_hits
+            << ",\"rehashes\":" << weight_cache_rehashes
+            << ",\"conversions\":" << weight_conversions
+            << ",\"convert_ms\":" << convert_ms_total << "}"
+            << ",\"resident\":[" << list.str() << "]}";
+        return out.str();
+    }
+
+    bool is_model_loaded() {
+        return acquire_model() != nullptr;
+    }
+
+    std::string get_model_path() {
+        auto model = acquire_model();
+        return model ? model->path : "";
+    }
+
+    // The initial model is loaded and warmed up
+    void note_startup_ready() {
+        auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                              std::chrono::steady_clock::now() - process_started).count();
+        std::lock_guard<std::mutex> lock(model_mutex);
+        startup_ready_ms = elapsed_ms;
+        std::cout << "Ready " << elapsed_ms << " ms after start" << std::endl;
+    }
+
+    // Called after every generation; only the first one is recorded
+    void note_image_served() {
+        std::lock_guard<std::mutex> lock(model_mutex);
+        if (startup_first_image_ms >= 0) {
+            return;
+        }
+        startup_first_image_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                     std::chrono::steady_clock::now() - process_started).count();
+        std::cout << "First image served " << startup_first_image_ms << " ms after start" << std::endl;
+    }
+
+    std::string startup_to_json() {
+        std::lock_guard<std::mutex> lock(model_mutex);
+        std::ostringstream out;
+        out << "{\"ready_ms\":" << startup_ready_ms
+            << ",\"first_image_ms\":" << startup_first_image_ms << "}";
+        return out.str();
+    }
+
+    // Path being loaded in the background, empty when idle
+    std::string get_loading_path() {
+        std::lock_guard<std::mutex> lock(model_mutex);
+        return loading_path;
+    }
+
+    std::string get_last_load_error() {
+        std::lock_guard<std::mutex> lock(model_mutex);
+        return last_load_error;
+    }
+
+    // Loads next to the model being served and makes it the default on
+    // success; the previous default stays resident within the budget and
+    // for as long as jobs are pinned to it.
+    // Generations keep running on the old model meanwhile; a failed load
+    // leaves it in place. Returns false immediately if another load is running.
+    bool load_model(const std::string& path, const ModelComponents& components = {}) {
+        return reserve_load(path) && load_placed(path, components);
+    }
+
+    // Same as load_model() but returns at once; progress is visible through
+    // get_loading_path() and get_last_load_error().
+    bool load_model_async(const std::string& path, const ModelComponents& components = {}) {
+        if (!reserve_load(path)) {
+            return false;
+        }
+        if (load_thread.joinable()) {
+            load_thread.join();  // previous load already released the slot
+        }
+        load_thread = std::thread([this, path, components] {
+            if (thread_init) {
+                thread_init();
+            }
+            load_reserved(path, components);
+        });
+        return true;
+    }
+
+
+// Returns one entry per batch image; an entry is empty when that image failed.
+GenerationResult generate_image(const std::shared_ptr<ModelInstance>& model,
+                                        const std::string& prompt,
+                                        const std::string& negative_prompt = "",
+                                        int width = 512,
+                                        int height = 512,
+                                        int steps = 20,
+                                        float cfg_scale = 7.0f,
+                                        int seed = -1,
+                                        int batch_count = 1) {
+    std::lock_guard<std::mutex> lock(generation_mutex);
+    GenerationResult generated;
+    std::vector<GeneratedImage>& images = generated.images;
+
+    if (!model || !model->sd_ctx) {
+        std::cout << "Model not loaded or context is null" << std::endl;
+        return generated;
+    }
+    generated.model_id = model->identity;
+    sd_ctx_t* sd_ctx = model->sd_ctx;
+    release_idle_models(model.get());
+
+    auto now = std::chrono::system_clock::now();
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count();
+
+    std::cout << "Starting generation with prompt: " << prompt << std::endl;
+
+    sd_image_t* results = nullptr;
+
+    try {
+        results = txt2img(sd_ctx,
+                          prompt.c_str(),
+                          negative_prompt.c_str(),
+                          -1,
+                          cfg_scale,
+                          1.0f,
+                          0.0f,
+                          width,
+                          height,
+                          EULER_A,
+                          steps,
+                          static_cast<int64_t>(seed),
+                          batch_count,
+                          nullptr,
+                          0.0f,
+                          0.0f,
+                          false,
+                          "",
+                          nullptr,
+                          0,
+                          0.0f,
+                          0.0f,
+                          1.0f);
+
+        if (!results) {
+            std::cout << "txt2img returned null" << std::endl;
+            return generated;
+        }
+
+        for (int i = 0; i < batch_count; ++i) {
+            if (!results[i].data) {
+                std::cout << "Image " << i << " is null, skipping" << std::endl;
+                images.push_back({});
+                continue;
+            }
+
+            std::string filename = "generated_" + std::to_string(ms + i) + ".png";
+            // Encoding and writing happen in encode_images(), after the
+            // generation lock is released
+            images.push_back({filename, nullptr});
+            generated.raw.resize(images.size());
+            RawImage& raw = generated.raw.back();
+            raw.width = results[i].width;
+            raw.height = results[i].height;
+            raw.channel = results[i].channel;
+            raw.data.reset(results[i].data);
+            results[i].data = nullptr;
+        }
+        generated.raw.resize(images.size());
+
+        // Memory free
+        for (int i = 0; i < batch_count; ++i) {
+            if (results[i].data) {
+                free(results[i].data);
+                results[i].data = nullptr;
+            }
+        }
+        free(results);
+        results = nullptr;
+
+    } catch (const std::exception& e) {
+        std::cout << "Exception during generation: " << e.what() << std::endl;
+        images.clear();
+        generated.raw.clear();
+    } catch (...) {
+        std::cout << "Unknown exception during generation" << std::endl;
+        images.clear();
+        generated.raw.clear();
+    }
+
+    std::cout << "Generation completed" << std::endl;
+    return generated;
+}
+
+    // Encode the raw images of a generation to PNG and write them. Runs on
+    // the job queue's encoder threads and needs no model or generation lock.
+    // Images of at least 2 * 128 rows are split into up to `png_threads`
+    // row bands, deflated by the calling thread and the shared band pool.
+    static void encode_images(GenerationResult& generated, int png_threads, PngBandPool& band_pool) {
+        for (size_t i = 0; i < generated.raw.size() && i < generated.images.size(); ++i) {
+            RawImage& raw = generated.raw[i];
+            GeneratedImage& image = generated.images[i];
+            if (!raw.data) {
+                continue;
+            }
+            // Encode to memory so the bytes can also go to the result cache.
+            // Per-call options: encoder threads may use different levels at once.
+            stbi_write_png_options options;
+            stbi_write_png_default_options(&options);
+            options.compression_level = raw.png_compression;
+            // Short bands cost compression ratio for little gain
+            options.bands = std::min(png_threads, static_cast<int>(raw.height / 128));
+            options.parallel_for = PngBandPool::parallel_for;
+            options.parallel_context = &band_pool;
+            int len = 0;
+            unsigned char* png = stbi_write_png_to_mem_ex(raw.data.get(),
+                                                          raw.width * raw.channel,
+                                                          raw.width,
+                                                          raw.height,
+                                                          raw.channel,
+                                                          &len,
+                                                          &options);
+            raw.data.reset();
+            bool saved = false;
+            if (png) {
+                auto bytes = std::make_shared<std::string>(reinterpret_cast<char*>(png), len);
+                STBIW_FREE(png);
+                std::ofstream file(image.filename, std::ios::binary);
+                saved = static_cast<bool>(file.write(bytes->data(), bytes->size()));
+                if (saved) {
+                    image.png = bytes;
+                }
+            }
+
+            if (saved) {
+                std::cout << "Saved: " << image.filename << std::endl;
+            } else {
+                std::cout << "Failed to save image: " << i << std::endl;
+                image = {};
+            }
+        }
+        generated.raw.clear();
+    }
+
+    // One-step txt2img per bucket, run like a generation: serialized with
+    // real ones and on a thread that ran thread_init, so the first request
+    // at these sizes does not pay for first-touch weight pages and heap
+    // growth. Returns an empty report when the model cannot be loaded.
+    std::vector<WarmupResult> warm_up(const std::string& model_path, const std::vector<WarmupBucket>& buckets) {
+        std::vector<WarmupResult> report;
+        auto run = [&] {
+            auto model = acquire_model(model_path);
+            if (!model || !model->sd_ctx) {
+                std::cout << "Warm-up skipped: model not loaded" << std::endl;
+                return;
+            }
+            std::lock_guard<std::mutex> lock(generation_mutex);
+            for (const WarmupBucket& bucket : buckets) {
+                auto started = std::chrono::steady_clock::now();
+                sd_image_t* images = txt2img(model->sd_ctx, "warm-up", "", -1, 7.0f, 1.0f, 0.0f,
+                                             bucket.width, bucket.height, EULER_A, 1, 42,
+                                             bucket.batch_count, nullptr, 0.0f, 0.0f, false, "",
+                                             nullptr, 0, 0.0f, 0.0f, 1.0f);
+                WarmupResult result;
+                result.bucket = bucket;
+                result.ok = images != nullptr;
+                if (images) {
+                    for (int i = 0; i < bucket.batch_count; ++i) {
+                        free(images[i].data);
+                    }
+                    free(images);
+                }
+                result.ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                std::chrono::steady_clock::now() - started).count();
+                std::cout << "Warm-up " << bucket.width << "x" << bucket.height << "x" << bucket.batch_count
+                          << ": " << result.ms << " ms" << std::endl;
+                report.push_back(result);
+            }
+        };
+        if (thread_init) {
+            std::thread runner([&] {
+                thread_init();
+                run();
+            });
+            runner.join();
+        } else {
+            run();
+        }
+
+        std::lock_guard<std::mutex> lock(model_mutex);
+        last_warmup = report;
+        return report;
+    }
+
+    static std::string warmup_to_json(const std::vector<WarmupResult>& report) {
+        std::ostringstream out;
+        out << "[";
+        for (size_t i = 0; i < report.size(); ++i) {
+            const WarmupResult& r = report[i];
+            out << (i ? "," : "")
+                << "{\"width\":" << r.bucket.width
+                << ",\"height\":" << r.bucket.height
+                << ",\"batch_count\":" << r.bucket.batch_count
+                << ",\"ms\":" << r.ms
+                << ",\"ok\":" << (r.ok ? "true" : "false") << "}";
+        }
+        out << "]";
+        return out.str();
+    }
+
+    std::string last_warmup_to_json() {
+        std::lock_guard<std::mutex> lock(model_mutex);
+        return warmup_to_json(last_warmup);
+    }
+
+    std::string generate_image_old(const std::string& prompt, 
+                              const std::string& negative_prompt = "",
+                              int width = 512, 
                               int height = 512,
                               int steps = 20,
                               float cfg_scale = 7.0f,
                               int seed = -1,
 							  int batch_count = 1) {
         
+        auto model = acquire_model();
         std::lock_guard<std::mutex> lock(generation_mutex);
         
-        if (!model_loaded || !sd_ctx) {
+        if (!model || !model->sd_ctx) {
             std::cout << "Model not loaded or context is null" << std::endl;
             return "";
         }
+        sd_ctx_t* sd_ctx = model->sd_ctx;
         
         // File name generation
         auto now = std::chrono::system_clock::now();
@@ -323,3 +1544,1736 @@ std::vector<std::string> generate_image(const std::string& prompt,
         return filename;
     }
 };
+
+
+// =================
+// CPU PLACEMENT
+// =================
+
+// Pins the generation context to one core set and, in NUMA mode, prefers
+// memory from the node those cores belong to. The placement is applied to
+// every thread that opens a context or runs generations; the ggml threads
+// they start inherit the affinity mask and memory policy, so both the
+// weights and the compute buffers are first touched on the chosen node.
+class CpuPlacement {
+public:
+    enum class Mode {
+        NONE,
+        COMPACT,  // consecutive physical cores, ignoring nodes
+        NUMA      // cores and memory of a single node
+    };
+
+private:
+    struct Node {
+        std::vector<int> cpus;  // physical cores first, hyperthread siblings last
+        int physical = 0;
+    };
+
+    Mode mode = Mode::NONE;
+    int node_count = 1;
+    int node = -1;  // -1: no memory policy
+    std::vector<int> cpus;
+
+    static std::vector<int> parse_cpu_list(const std::string& list) {
+        std::vector<int> cpus;
+        std::stringstream ss(list);
+        std::string range;
+        while (std::getline(ss, range, ',')) {
+            if (range.empty() || !isdigit(static_cast<unsigned char>(range[0]))) {
+                continue;
+            }
+            size_t dash = range.find('-');
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        }
+        return cpus;
+    }
+
+    static std::string format_cpu_list(const std::vector<int>& cpus) {
+        std::string out;
+        for (size_t i = 0; i < cpus.size();) {
+            size_t j = i;
+            while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) ++j;
+            if (!out.empty()) out += ",";
+            out += std::to_string(cpus[i]);
+            if (j > i) out += "-" + std::to_string(cpus[j]);
+            i = j + 1;
+        }
+        return out;
+    }
+
+    static std::string read_line(const std::string& path) {
+        std::ifstream file(path);
+        std::string line;
+        std::getline(file, line);
+        return line;
+    }
+
+    // Allowed CPUs of each node, from /sys filtered by the process affinity mask
+    static std::vector<Node> read_topology() {
+        std::vector<int> allowed;
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                if (CPU_ISSET(cpu, &set)) allowed.push_back(cpu);
+            }
+        }
+#endif
+        if (allowed.empty()) {
+            for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu) {
+                allowed.push_back(static_cast<int>(cpu));
+            }
+        }
+
+        std::vector<Node> nodes;
+        std::error_code ec;
+        std::vector<std::filesystem::path> node_dirs;
+        for (auto& entry : std::filesystem::directory_iterator("/sys/devices/system/node", ec)) {
+            std::string name = entry.path().filename().string();
+            if (name.rfind("node", 0) == 0 && name.size() > 4 && isdigit(static_cast<unsigned char>(name[4]))) {
+                node_dirs.push_back(entry.path());
+            }
+        }
+        std::sort(node_dirs.begin(), node_dirs.end());
+        for (auto& dir : node_dirs) {
+            Node n;
+            for (int cpu : parse_cpu_list(read_line((dir / "cpulist").string()))) {
+                if (std::find(allowed.begin(), allowed.end(), cpu) != allowed.end()) {
+                    n.cpus.push_back(cpu);
+                }
+            }
+            if (!n.cpus.empty()) {
+                nodes.push_back(n);
+            }
+        }
+        if (nodes.empty()) {
+            nodes.push_back(Node{allowed, 0});
+        }
+
+        for (auto& n : nodes) {
+            auto siblings_end = std::stable_partition(n.cpus.begin(), n.cpus.end(), [](int cpu) {
+                auto siblings = parse_cpu_list(read_line("/sys/devices/system/cpu/cpu" +
+                                                         std::to_string(cpu) + "/topology/thread_siblings_list"));
+                return siblings.empty() || siblings[0] == cpu;
+            });
+            n.physical = static_cast<int>(siblings_end - n.cpus.begin());
+        }
+        return nodes;
+    }
+
+public:
+    static bool parse_mode(const std::string& name, Mode& out) {
+        if (name == "none") { out = Mode::NONE; return true; }
+        if (name == "compact") { out = Mode::COMPACT; return true; }
+        if (name == "numa") { out = Mode::NUMA; return true; }
+        return false;
+    }
+
+    // Picks `n_threads` CPUs for the generation context; 0 takes every
+    // physical core the mode allows (one node's in numa mode)
+    void plan(Mode placement_mode, int n_threads) {
+        mode = placement_mode;
+        auto nodes = read_topology();
+        node_count = static_cast<int>(nodes.size());
+        if (mode == Mode::NONE) {
+            return;
+        }
+
+        std::vector<int> pool;
+        int physical = 0;
+        if (mode == Mode::NUMA) {
+            // The node with the most physical cores takes the whole context
+            size_t best = 0;
+            for (size_t n = 1; n < nodes.size(); ++n) {
+                if (nodes[n].physical > nodes[best].physical) best = n;
+            }
+            node = static_cast<int>(best);
+            pool = nodes[best].cpus;
+            physical = nodes[best].physical;
+        } else {
+            // Physical cores of every node before any hyperthread sibling
+            for (auto& n : nodes) {
+                pool.insert(pool.end(), n.cpus.begin(), n.cpus.begin() + n.physical);
+                physical += n.physical;
+            }
+            for (auto& n : nodes) {
+                pool.insert(pool.end(), n.cpus.begin() + n.physical, n.cpus.end());
+            }
+        }
+        int count = n_threads > 0 ? n_threads : std::max(1, physical);
+        cpus.assign(pool.begin(), pool.begin() + std::min<size_t>(pool.size(), count));
+        std::sort(cpus.begin(), cpus.end());
+
+        std::cout << "Generation placement: cpus " << format_cpu_list(cpus);
+        if (node >= 0) std::cout << ", node " << node;
+        std::cout << std::endl;
+    }
+
+    // Threads the placement has room for, 0 when unplaced
+    int cpu_count() const {
+        return static_cast<int>(cpus.size());
+    }
+
+    // Apply the placement to the calling thread
+    void apply() const {
+        if (mode == Mode::NONE || cpus.empty()) {
+            return;
+        }
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus) CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+            std::cout << "Failed to pin generation thread: " << strerror(errno) << std::endl;
+        }
+        if (node >= 0 && node < 64) {
+            unsigned long node_mask = 1UL << node;
+            if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &node_mask, sizeof(node_mask) * 8) != 0) {
+                std::cout << "Failed to set memory policy: " << strerror(errno) << std::endl;
+            }
+        }
+#else
+        std::cout << "CPU placement is only supported on Linux" << std::endl;
+#endif
+    }
+
+    std::string to_json() const {
+        static const char* names[] = {"none", "compact", "numa"};
+        std::ostringstream out;
+        out << "{\"mode\":\"" << names[static_cast<int>(mode)] << "\""
+            << ",\"nodes\":" << node_count
+            << ",\"node\":" << node
+            << ",\"cpus\":\"" << format_cpu_list(cpus) << "\"}";
+        return out.str();
+    }
+};
+
+// =================
+// RESULT CACHE
+// =================
+
+// Content-addressed LRU of encoded images. A txt2img image is fully
+// determined by the model, every generation parameter and its seed, so
+// each image is stored under that tuple and requests with a fixed seed
+// can be answered without sampling. Bounded by the total PNG bytes held.
+class ResultCache {
+private:
+    struct Entry {
+        GeneratedImage image;
+        std::list<std::string>::iterator lru_it;
+    };
+
+    std::mutex cache_mutex;
+    std::unordered_map<std::string, Entry> entries;
+    std::list<std::string> lru;  // most recently used first
+    size_t max_bytes;
+    size_t bytes = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t collapsed = 0;
+
+    // Every parameter that affects the pixels, except the seed
+    static std::string params_key(const std::string& model_id, const GenerationParams& p) {
+        std::ostringstream key;
+        key << model_id << '\0' << p.prompt << '\0' << p.negative_prompt << '\0'
+            << p.width << 'x' << p.height << '\0' << p.steps << '\0'
+            << std::hexfloat << p.cfg_scale;
+        return key.str();
+    }
+
+public:
+    explicit ResultCache(size_t max_bytes) : max_bytes(max_bytes) {}
+
+    bool enabled() const {
+        return max_bytes > 0;
+    }
+
+    static std::string image_key(const std::string& model_id, const GenerationParams& p, int64_t seed) {
+        return params_key(model_id, p) + '\0' + std::to_string(seed);
+    }
+
+    // Identifies a whole request, for collapsing identical in-flight jobs
+    static std::string job_key(const std::string& model_id, const GenerationParams& p) {
+        return image_key(model_id, p, p.seed) + '\0' + std::to_string(p.batch_count);
+    }
+
+    void put(const std::string& key, const GeneratedImage& image) {
+        if (!enabled() || !image.png || image.png->size() > max_bytes) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        auto it = entries.find(key);
+        if (it != entries.end()) {
+            bytes -= it->second.image.png->size();
+            lru.erase(it->second.lru_it);
+            entries.erase(it);
+        }
+        lru.push_front(key);
+        entries[key] = {image, lru.begin()};
+        bytes += image.png->size();
+        while (bytes > max_bytes && !lru.empty()) {
+            auto victim = entries.find(lru.back());
+            bytes -= victim->second.image.png->size();
+            entries.erase(victim);
+            lru.pop_back();
+            evictions++;
+        }
+    }
+
+    // All images of a fixed-seed request, or false if any is missing. Does
+    // no file I/O; callers pass the images to restore_files() once they
+    // hold no locks.
+    bool lookup(const std::string& model_id, const GenerationParams& p, std::vector<GeneratedImage>& images) {
+        if (!enabled() || p.seed < 0) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        std::vector<Entry*> found;
+        for (int i = 0; i < p.batch_count; ++i) {
+            auto it = entries.find(image_key(model_id, p, static_cast<int64_t>(p.seed) + i));
+            if (it == entries.end()) {
+                misses++;
+                return false;
+            }
+            found.push_back(&it->second);
+        }
+        images.clear();
+        for (Entry* entry : found) {
+            lru.splice(lru.begin(), lru, entry->lru_it);
+            images.push_back(entry->image);
+        }
+        hits++;
+        return true;
+    }
+
+    // Rewrite image files deleted from disk since they were cached
+    static void restore_files(const std::vector<GeneratedImage>& images) {
+        for (const GeneratedImage& image : images) {
+            if (!std::filesystem::exists(image.filename)) {
+                std::ofstream file(image.filename, std::ios::binary);
+                file.write(image.png->data(), image.png->size());
+            }
+        }
+    }
+
+    void count_collapsed() {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        collapsed++;
+    }
+
+    std::string to_json() {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        uint64_t lookups = hits + misses;
+        std::ostringstream out;
+        out << "{\"hits\":" << hits
+            << ",\"misses\":" << misses
+            << ",\"hit_rate\":" << (lookups ? static_cast<double>(hits) / lookups : 0.0)
+            << ",\"collapsed\":" << collapsed
+            << ",\"evictions\":" << evictions
+            << ",\"entries\":" << entries.size()
+            << ",\"bytes\":" << bytes
+            << ",\"max_bytes\":" << max_bytes << "}";
+        return out.str();
+    }
+};
+
+// =================
+// JOB QUEUE
+// =================
+
+// Bounded priority queue of generation jobs drained by a single executor
+// thread. HTTP handlers only submit and poll; they never wait on generation.
+// Jobs are ordered by priority, FIFO within the same priority.
+//
+// Queued jobs with the same conditioning and sampling parameters are
+// merged into a single txt2img call (up to max_batch images) and the
+// results are split back per job. txt2img uses seed + i for image i, so
+// random-seed jobs get consecutive slices of one random base seed and
+// explicit-seed jobs only merge when their seeds continue the run.
+//
+// The library has no way to stop a txt2img call once it started, so a
+// cancelled running job still samples to the end; its images are then
+// discarded. Priority only orders the queue and never preempts a run.
+//
+// Fixed-seed jobs are first looked up in the result cache. A job identical
+// to one still queued or running becomes its follower: it is not queued
+// itself and receives the leader's images.
+//
+// Within a priority class, jobs whose model is already resident run before
+// jobs that would need a model load, so interleaved requests for different
+// checkpoints are served in groups. A job that has waited longer than
+// max_model_wait runs next regardless.
+//
+// PNG encoding and file writes run on a separate encoder pool: the
+// executor hands its sampled images over and takes the next job at once.
+// Jobs stay RUNNING (phase "encoding") until their images are written.
+class JobQueue {
+public:
+    // Must return one entry per requested image, empty for failed images
+    using Runner = std::function<GenerationResult(const GenerationParams&)>;
+    // Turns the runner's raw images into files; runs on the encoder threads
+    using Encoder = std::function<void(GenerationResult&)>;
+
+private:
+    using Batch = std::vector<std::shared_ptr<GenerationJob>>;
+
+    // Batch being sampled on the executor thread, read by on_progress()
+    static inline thread_local Batch* current_batch = nullptr;
+
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    std::condition_variable job_cv;  // any job changed state or progress
+    std::deque<std::shared_ptr<GenerationJob>> pending;
+    std::unordered_map<std::string, std::shared_ptr<GenerationJob>> jobs;
+    std::deque<std::string> finished_order;
+    std::vector<std::shared_ptr<GenerationJob>> running;  // sampling or encoding
+    std::thread executor;
+    Runner runner;
+    std::function<void()> executor_init;
+
+    // Encoder pool: the executor hands sampled batches over and takes the
+    // next job while the previous images are compressed and written. At
+    // most encode_backlog batches wait; a full backlog stalls the executor,
+    // so sampling cannot outrun encoding and pile up raw images.
+    Encoder encoder;
+    int n_encoders = 0;
+    size_t encode_backlog = 0;
+    std::vector<std::thread> encoders;
+    std::mutex encode_mutex;
+    std::condition_variable encode_cv;
+    std::condition_variable encode_room_cv;           // a waiting batch was taken
+    std::deque<std::function<void()>> encode_tasks;  // guarded by encode_mutex
+    bool encoders_stopping = false;                   // guarded by encode_mutex
+    uint64_t encoded_batches = 0;
+    int64_t encode_ms_total = 0;
+    ResultCache* result_cache = nullptr;
+    std::unordered_map<std::string, std::shared_ptr<GenerationJob>> inflight;  // dedup_key -> leader
+    std::function<bool(const std::string&)> model_ready;  // resident or loading; no swap needed
+    std::chrono::milliseconds max_model_wait{30000};       // 0 disables reordering
+    size_t max_queued;
+    size_t max_history;
+    int max_batch;
+    uint64_t next_id = 1;
+    bool stopping = false;
+    std::mt19937_64 seed_rng{std::random_device{}()};
+
+    // Admission control: outstanding (queued + running) cost in pixel-steps
+    double cost_budget = 0.0;         // 0 disables the global budget
+    double client_cost_budget = 0.0;  // 0 disables the per-client budget
+    double outstanding_cost = 0.0;
+    std::unordered_map<std::string, double> client_cost;
+    double throughput = 0.0;          // measured pixel-steps per second (EWMA)
+    uint64_t rejected = 0;
+
+    // Batching statistics
+    uint64_t runs = 0;
+    uint64_t merged_jobs = 0;
+    uint64_t cancelled = 0;
+    uint64_t affinity_picks = 0;   // a resident-model job ran ahead of older ones
+    uint64_t starvation_picks = 0; // the oldest job ran because it hit max_model_wait
+
+    static bool same_conditioning(const GenerationParams& a, const GenerationParams& b) {
+        return a.model == b.model &&
+               a.model_path == b.model_path &&
+               a.prompt == b.prompt &&
+               a.negative_prompt == b.negative_prompt &&
+               a.width == b.width &&
+               a.height == b.height &&
+               a.steps == b.steps &&
+               a.cfg_scale == b.cfg_scale;
+    }
+
+    // Insert behind every job of higher or equal priority. Called with queue_mutex held.
+    void enqueue(const std::shared_ptr<GenerationJob>& job) {
+        auto it = pending.begin();
+        while (it != pending.end() && (*it)->params.priority >= job->params.priority) {
+            ++it;
+        }
+        pending.insert(it, job);
+    }
+
+    // Jobs pinned at submit hold their instance, so only a named model that
+    // was not resident then can need a load. Called with queue_mutex held.
+    bool is_ready(const GenerationJob& job) const {
+        return job.params.model || !model_ready || model_ready(job.params.model_path);
+    }
+
+    // The job to run next: the front job, unless it needs a model swap and a
+    // job of the same priority can run on a resident model. Called with
+    // queue_mutex held.
+    std::deque<std::shared_ptr<GenerationJob>>::iterator pick_lead() {
+        auto front = pending.begin();
+        if (max_model_wait.count() <= 0 || is_ready(**front)) {
+            return front;
+        }
+        if (std::chrono::steady_clock::now() - (*front)->submitted_at >= max_model_wait) {
+            starvation_picks++;
+            return front;
+        }
+        for (auto it = std::next(front); it != pending.end() &&
+             (*it)->params.priority == (*front)->params.priority; ++it) {
+            if (is_ready(**it)) {
+                affinity_picks++;
+                return it;
+            }
+        }
+        return front;
+    }
+
+    // Pop the lead job plus every queued job that can share its txt2img call.
+    // Called with queue_mutex held.
+    std::vector<std::shared_ptr<GenerationJob>> take_batch() {
+        std::vector<std::shared_ptr<GenerationJob>> batch;
+        auto lead_it = pick_lead();
+        batch.push_back(*lead_it);
+        pending.erase(lead_it);
+
+        const GenerationParams& lead = batch[0]->params;
+        int images = lead.batch_count;
+        int next_seed = lead.seed < 0 ? -1 : lead.seed + lead.batch_count;
+
+        for (auto it = pending.begin(); it != pending.end() && images < max_batch;) {
+            const GenerationParams& p = (*it)->params;
+            bool seed_ok = lead.seed < 0 ? p.seed < 0 : p.seed == next_seed;
+            if (seed_ok && images + p.batch_count <= max_batch && same_conditioning(lead, p)) {
+                images += p.batch_count;
+                if (next_seed >= 0) {
+                    next_seed += p.batch_count;
+                }
+                batch.push_back(*it);
+                it = pending.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        return batch;
+    }
+
+    // Called with queue_mutex held
+    void finish(const std::shared_ptr<GenerationJob>& job, JobState state,
+                std::chrono::steady_clock::time_point now) {
+        job->state = state;
+        job->finished_at = now;
+        job->version++;
+        if (job->cost_reserved) {
+            release_cost(*job);
+            job->cost_reserved = false;
+        }
+        if (!job->dedup_key.empty()) {
+            auto it = inflight.find(job->dedup_key);
+            if (it != inflight.end() && it->second == job) {
+                inflight.erase(it);
+            }
+        }
+        job->params.model.reset();
+        if (state == JobState::CANCELLED) {
+            job->filenames.clear();
+            job->error = "Cancelled";
+            cancelled++;
+        }
+        remember_finished(job->id);
+    }
+
+    // Called with queue_mutex held
+    void reserve_cost(GenerationJob& job) {
+        double cost = job.params.cost();
+        outstanding_cost += cost;
+        client_cost[job.client] += cost;
+        job.cost_reserved = true;
+    }
+
+    // Move a follower into the state of its leader. Called with queue_mutex held.
+    static void mirror_leader(GenerationJob& follower, const GenerationJob& leader) {
+        follower.state = leader.state;
+        follower.started_at = std::max(leader.started_at, follower.submitted_at);
+        follower.seed_used = leader.seed_used;
+        follower.batched_with = leader.batched_with;
+        follower.step = leader.step;
+        follower.total_steps = leader.total_steps;
+        follower.decoding = leader.decoding;
+        follower.encoding = leader.encoding;
+        follower.step_time_sum = leader.step_time_sum;
+        follower.step_samples = leader.step_samples;
+        follower.version++;
+    }
+
+    // Called with queue_mutex held
+    void release_cost(const GenerationJob& job) {
+        double cost = job.params.cost();
+        outstanding_cost = std::max(0.0, outstanding_cost - cost);
+        auto it = client_cost.find(job.client);
+        if (it != client_cost.end()) {
+            it->second -= cost;
+            if (it->second <= 0.5) {
+                client_cost.erase(it);
+            }
+        }
+    }
+
+    // Seconds until `excess` pixel-steps of work drain at the measured rate.
+    // Called with queue_mutex held.
+    int retry_after_seconds(double excess) const {
+        if (throughput <= 0.0) {
+            return 10;
+        }
+        return static_cast<int>(std::min(3600.0, std::max(1.0, std::ceil(excess / throughput))));
+    }
+
+    void executor_loop() {
+        if (executor_init) {
+            executor_init();
+        }
+        while (true) {
+            std::vector<std::shared_ptr<GenerationJob>> batch;
+            GenerationParams merged;
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                queue_cv.wait(lock, [this] { return stopping || !pending.empty(); });
+                if (stopping) {
+                    return;
+                }
+                batch = take_batch();
+
+                merged = batch[0]->params;
+                merged.batch_count = 0;
+                if (merged.seed < 0) {
+                    merged.seed = static_cast<int>(seed_rng() % 0x7FFF0000);
+                }
+                auto now = std::chrono::steady_clock::now();
+                // Every job waits for the whole call, so progress covers all its images
+                int images = 0;
+                for (auto& job : batch) {
+                    images += job->params.batch_count;
+                }
+                for (auto& job : batch) {
+                    job->seed_used = merged.seed + merged.batch_count;
+                    job->batched_with = static_cast<int>(batch.size()) - 1;
+                    job->state = JobState::RUNNING;
+                    job->started_at = now;
+                    job->step = 0;
+                    job->total_steps = merged.steps * images;
+                    job->image = 0;
+                    job->image_step = 0;
+                    job->decoding = false;
+                    job->encoding = false;
+                    job->step_time_sum = 0.0f;
+                    job->step_samples = 0;
+                    job->version++;
+                    merged.batch_count += job->params.batch_count;
+                    for (auto& follower : job->followers) {
+                        mirror_leader(*follower, *job);
+                    }
+                }
+                running.insert(running.end(), batch.begin(), batch.end());
+                runs++;
+                merged_jobs += batch.size() - 1;
+            }
+
+            if (batch.size() > 1) {
+                std::cout << "Batching " << batch.size() << " jobs into one run of "
+                          << merged.batch_count << " images" << std::endl;
+            }
+
+            GenerationResult result;
+            std::vector<GeneratedImage>& slots = result.images;
+            std::string error;
+            auto run_started = std::chrono::steady_clock::now();
+            current_batch = &batch;
+            try {
+                result = runner(merged);
+                if (slots.empty()) {
+                    error = "Generation failed";
+                }
+            } catch (const std::exception& e) {
+                error = e.what();
+            } catch (...) {
+                error = "Unknown exception during generation";
+            }
+            current_batch = nullptr;
+            auto sampled_at = std::chrono::steady_clock::now();
+            // Merged jobs may ask for different levels; each image keeps its job's
+            size_t image = 0;
+            for (auto& job : batch) {
+                for (int i = 0; i < job->params.batch_count && image < result.raw.size(); ++i) {
+                    result.raw[image++].png_compression = job->params.png_compression;
+                }
+            }
+            bool handed_over = encoder && n_encoders > 0 && !result.raw.empty() && error.empty();
+            if (encoder && n_encoders == 0 && !result.raw.empty() && error.empty()) {
+                error = encode(result);
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                // Throughput counts sampling only; encoding overlaps the next job
+                double seconds = std::chrono::duration<double>(sampled_at - run_started).count();
+                if (!slots.empty() && seconds > 0.0) {
+                    double rate = merged.cost() / seconds;
+                    throughput = throughput > 0.0 ? 0.8 * throughput + 0.2 * rate : rate;
+                }
+                if (handed_over) {
+                    for (auto& job : batch) {
+                        job->encoding = true;
+                        job->version++;
+                        for (auto& follower : job->followers) {
+                            mirror_leader(*follower, *job);
+                        }
+                    }
+                } else {
+                    complete_batch(batch, result, error, std::chrono::steady_clock::now());
+                }
+            }
+            job_cv.notify_all();
+            if (handed_over) {
+                auto encoded = std::make_shared<GenerationResult>(std::move(result));
+                std::unique_lock<std::mutex> lock(encode_mutex);
+                encode_room_cv.wait(lock, [this] { return encode_tasks.size() < encode_backlog; });
+                encode_tasks.push_back([this, batch, encoded] {
+                    auto started = std::chrono::steady_clock::now();
+                    std::string error = encode(*encoded);
+                    {
+                        std::lock_guard<std::mutex> lock(queue_mutex);
+                        auto now = std::chrono::steady_clock::now();
+                        encoded_batches++;
+                        encode_ms_total += std::chrono::duration_cast<std::chrono::milliseconds>(
+                                               now - started).count();
+                        complete_batch(batch, *encoded, error, now);
+                    }
+                    job_cv.notify_all();
+                });
+                encode_cv.notify_one();
+            }
+        }
+    }
+
+    void encoder_loop() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(encode_mutex);
+                encode_cv.wait(lock, [this] { return encoders_stopping || !encode_tasks.empty(); });
+                if (encode_tasks.empty()) {
+                    return;  // stopping, and everything handed over is written
+                }
+                task = std::move(encode_tasks.front());
+                encode_tasks.pop_front();
+            }
+            encode_room_cv.notify_one();
+            task();
+        }
+    }
+
+    // Run the encoder; a throw fails the batch instead of the thread
+    std::string encode(GenerationResult& result) {
+        try {
+            encoder(result);
+        } catch (const std::exception& e) {
+            return std::string("Encoding failed: ") + e.what();
+        } catch (...) {
+            return "Unknown exception during encoding";
+        }
+        return "";
+    }
+
+    // Split a finished run back into its jobs and finish them.
+    // Called with queue_mutex held.
+    void complete_batch(const Batch& batch, GenerationResult& result, const std::string& error,
+                        std::chrono::steady_clock::time_point now) {
+        std::vector<GeneratedImage>& slots = result.images;
+        size_t offset = 0;
+        for (auto& job : batch) {
+            std::vector<std::string> filenames;
+            for (int i = 0; i < job->params.batch_count; ++i, ++offset) {
+                if (offset < slots.size() && !slots[offset].filename.empty()) {
+                    filenames.push_back(slots[offset].filename);
+                    if (result_cache) {
+                        result_cache->put(ResultCache::image_key(result.model_id, job->params,
+                                                                 job->seed_used + i),
+                                          slots[offset]);
+                    }
+                }
+            }
+            std::string job_error = error;
+            if (job_error.empty() && filenames.empty()) {
+                job_error = "Generation failed";
+            }
+            JobState state = job_error.empty() ? JobState::COMPLETED : JobState::FAILED;
+            for (auto& follower : job->followers) {
+                follower->filenames = filenames;
+                follower->error = job_error;
+                finish(follower, state, now);
+            }
+            job->followers.clear();
+            job->filenames = std::move(filenames);
+            job->error = job_error;
+            // Cancelled while sampling: the images were made but are not returned
+            finish(job, job->cancel_requested ? JobState::CANCELLED : state, now);
+            running.erase(std::remove(running.begin(), running.end(), job), running.end());
+        }
+    }
+
+    // A finished job for a fixed-seed request whose images are all cached,
+    // or a follower of an identical queued or running job; nullptr otherwise,
+    // with `dedup_key` set for the job about to be queued. `cached` receives
+    // the images a cache hit returns. Called with queue_mutex held.
+    std::shared_ptr<GenerationJob> serve_deterministic(const GenerationParams& params, const std::string& client,
+                                                       std::vector<GeneratedImage>& cached,
+                                                       std::string& dedup_key) {
+        std::string model_id = params.model ? params.model->identity
+                                            : StableDiffusionServer::file_identity(params.model_path);
+        auto now = std::chrono::steady_clock::now();
+        auto job = std::make_shared<GenerationJob>();
+        job->client = client;
+        job->model_path = params.model ? params.model->path : params.model_path;
+        job->params = params;
+        job->submitted_at = now;
+
+        if (result_cache->lookup(model_id, params, cached)) {
+            job->id = "job-" + std::to_string(next_id++);
+            job->seed_used = params.seed;
+            job->from_cache = true;
+            for (auto& image : cached) {
+                job->filenames.push_back(image.filename);
+            }
+            job->started_at = now;
+            jobs[job->id] = job;
+            finish(job, JobState::COMPLETED, now);
+            return job;
+        }
+
+        dedup_key = ResultCache::job_key(model_id, params);
+        auto it = inflight.find(dedup_key);
+        if (it == inflight.end()) {
+            return nullptr;
+        }
+        job->id = "job-" + std::to_string(next_id++);
+        job->leader = it->second;
+        job->collapsed_into = it->second->id;
+        mirror_leader(*job, *it->second);
+        it->second->followers.push_back(job);
+        jobs[job->id] = job;
+        result_cache->count_collapsed();
+        return job;
+    }
+
+    // Keep only the most recent finished jobs so the table does not grow forever
+    void remember_finished(const std::string& id) {
+        finished_order.push_back(id);
+        while (finished_order.size() > max_history) {
+            jobs.erase(finished_order.front());
+            finished_order.pop_front();
+        }
+    }
+
+    static bool is_finished(JobState state) {
+        return state == JobState::COMPLETED || state == JobState::FAILED ||
+               state == JobState::CANCELLED;
+    }
+
+public:
+    JobQueue(size_t max_queued, size_t max_history, int max_batch)
+        : max_queued(max_queued), max_history(max_history), max_batch(std::max(1, max_batch)) {}
+
+    // Why a submission was refused, with a Retry-After hint for 429 responses
+    struct Rejection {
+        int status = 0;
+        std::string reason;
+        int retry_after = 0;
+    };
+
+    void set_result_cache(ResultCache* cache) {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        result_cache = cache && cache->enabled() ? cache : nullptr;
+    }
+
+    // `ready` tells whether a named model can run without a load; jobs older
+    // than `max_wait` are not overtaken by jobs for resident models
+    void set_model_affinity(std::function<bool(const std::string&)> ready, std::chrono::milliseconds max_wait) {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        model_ready = std::move(ready);
+        max_model_wait = max_wait;
+    }
+
+    // Budgets are in pixel-steps (width * height * steps * batch_count)
+    void set_cost_budget(double total, double per_client) {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        cost_budget = total;
+        client_cost_budget = per_client;
+    }
+
+    ~JobQueue() {
+        stop();
+    }
+
+    // Step hook for sd_set_progress_callback(); data is the JobQueue.
+    // Sampling reports steps == sample_steps and restarts at step 1 for each
+    // image of the call; tiled VAE decoding reuses the callback with the
+    // tile count, which is reported as a decoding phase.
+    static void on_progress(int step, int steps, float time, void* data) {
+        Batch* batch = current_batch;
+        if (!batch || !data) {
+            return;
+        }
+        JobQueue* queue = static_cast<JobQueue*>(data);
+        {
+            std::lock_guard<std::mutex> lock(queue->queue_mutex);
+            for (auto& job : *batch) {
+                bool sampling = steps == job->params.steps && !job->decoding;
+                if (sampling) {
+                    if (step <= job->image_step) {
+                        job->image++;  // the sampler moved on to the next image
+                    }
+                    job->image_step = step;
+                    job->step_time_sum += time;
+                    job->step_samples++;
+                    job->step = std::min(job->image * steps + step, job->total_steps);
+                } else {
+                    job->decoding = true;
+                    job->step = step;
+                    job->total_steps = steps;
+                }
+                job->version++;
+                for (auto& follower : job->followers) {
+                    mirror_leader(*follower, *job);
+                }
+            }
+        }
+        queue->job_cv.notify_all();
+    }
+
+    // `init` runs once on the executor thread before it takes any job
+    // With 0 threads the executor encodes its own results before taking the
+    // next job; otherwise up to two batches per encoder thread may wait
+    void set_encoder(Encoder job_encoder, int threads) {
+        encoder = std::move(job_encoder);
+        n_encoders = std::max(0, threads);
+        encode_backlog = 2 * static_cast<size_t>(n_encoders);
+    }
+
+    void start(Runner job_runner, std::function<void()> init = nullptr) {
+        runner = std::move(job_runner);
+        executor_init = std::move(init);
+        for (int i = 0; i < n_encoders; ++i) {
+            encoders.emplace_back(&JobQueue::encoder_loop, this);
+        }
+        executor = std::thread(&JobQueue::executor_loop, this);
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            if (stopping) {
+                return;
+            }
+            stopping = true;
+            for (auto& job : pending) {
+                job->state = JobState::FAILED;
+                job->error = "Server shutting down";
+            }
+            pending.clear();
+        }
+        queue_cv.notify_all();
+        job_cv.notify_all();
+        if (executor.joinable()) {
+            executor.join();
+        }
+        // Images already sampled are still written
+        {
+            std::lock_guard<std::mutex> lock(encode_mutex);
+            encoders_stopping = true;
+        }
+        encode_cv.notify_all();
+        for (auto& thread : encoders) {
+            if (thread.joinable()) {
+                thread.join();
+            }
+        }
+        encoders.clear();
+    }
+
+    // Returns nullptr and fills `rejection` when the job is not admitted
+    std::shared_ptr<GenerationJob> submit(const GenerationParams& params, const std::string& client,
+                                          Rejection& rejection) {
+        std::shared_ptr<GenerationJob> job;
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            double cost = params.cost();
+            if (stopping) {
+                rejection = {503, "Server shutting down", 0};
+                return nullptr;
+            }
+
+            // Deterministic requests: serve from the cache or share an identical job
+            std::string dedup_key;
+            if (result_cache && params.seed >= 0) {
+                std::vector<GeneratedImage> cached;
+                job = serve_deterministic(params, client, cached, dedup_key);
+                if (job) {
+                    lock.unlock();
+                    // Rewriting deleted files is the only I/O; neither queue nor cache lock is held
+                    ResultCache::restore_files(cached);
+                    return job;
+                }
+            }
+
+            if (pending.size() >= max_queued) {
+                rejection = {429, "Generation queue is full", retry_after_seconds(cost)};
+                rejected++;
+                return nullptr;
+            }
+            // A job larger than a budget on its own is admitted once nothing
+            // else is outstanding against that budget
+            if (cost_budget > 0.0 && outstanding_cost > 0.0 && outstanding_cost + cost > cost_budget) {
+                rejection = {429, "Server over capacity",
+                             retry_after_seconds(outstanding_cost + cost - cost_budget)};
+                rejected++;
+                return nullptr;
+            }
+            double client_outstanding = client_cost.count(client) ? client_cost[client] : 0.0;
+            if (client_cost_budget > 0.0 && client_outstanding > 0.0 &&
+                client_outstanding + cost > client_cost_budget) {
+                rejection = {429, "Too much outstanding work for this client",
+                             retry_after_seconds(client_outstanding + cost - client_cost_budget)};
+                rejected++;
+                return nullptr;
+            }
+            job = std::make_shared<GenerationJob>();
+            job->id = "job-" + std::to_string(next_id++);
+            job->client = client;
+            job->model_path = params.model ? params.model->path : params.model_path;
+            job->params = params;
+            job->dedup_key = dedup_key;
+            reserve_cost(*job);
+            if (!dedup_key.empty()) {
+                inflight[dedup_key] = job;
+            }
+            job->submitted_at = std::chrono::steady_clock::now();
+            enqueue(job);
+            jobs[job->id] = job;
+        }
+        queue_cv.notify_one();
+        return job;
+    }
+
+    // Cancel a queued job immediately or flag a running one, whose images are
+    // dropped when sampling ends. Returns false for unknown or finished jobs.
+    bool cancel(const std::string& id) {
+        std::shared_ptr<ModelInstance> pin;  // may be the last reference; freed after unlocking
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            auto it = jobs.find(id);
+            if (it == jobs.end() || is_finished(it->second->state)) {
+                return false;
+            }
+            auto job = it->second;
+            auto now = std::chrono::steady_clock::now();
+            job->cancel_requested = true;
+            job->version++;
+            if (auto leader = job->leader.lock()) {
+                // A follower just detaches; the leader runs on for the others
+                auto& followers = leader->followers;
+                followers.erase(std::remove(followers.begin(), followers.end(), job), followers.end());
+                finish(job, JobState::CANCELLED, now);
+            } else if (job->state == JobState::QUEUED) {
+                pin = job->params.model;
+                auto pos = std::find(pending.begin(), pending.end(), job);
+                if (!job->followers.empty()) {
+                    // Hand the queue slot and the remaining followers to the oldest follower
+                    auto heir = job->followers.front();
+                    heir->leader.reset();
+                    heir->collapsed_into.clear();
+                    heir->followers.assign(job->followers.begin() + 1, job->followers.end());
+                    for (auto& follower : heir->followers) {
+                        follower->leader = heir;
+                        follower->collapsed_into = heir->id;
+                    }
+                    job->followers.clear();
+                    heir->dedup_key = job->dedup_key;
+                    reserve_cost(*heir);
+                    finish(job, JobState::CANCELLED, now);
+                    inflight[heir->dedup_key] = heir;
+                    if (pos != pending.end()) {
+                        *pos = heir;
+                    }
+                } else {
+                    if (pos != pending.end()) {
+                        pending.erase(pos);
+                    }
+                    finish(job, JobState::CANCELLED, now);
+                }
+            }
+        }
+        job_cv.notify_all();
+        return true;
+    }
+
+    // Wait until the job changes past `seen_version` (updated on return).
+    // Returns false on timeout or when the job is no longer known.
+    bool wait_for_update(const std::string& id, uint64_t& seen_version,
+                         std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        auto it = jobs.find(id);
+        if (it == jobs.end()) {
+            return false;
+        }
+        auto job = it->second;
+        if (!job_cv.wait_for(lock, timeout, [&] { return job->version != seen_version; })) {
+            return false;
+        }
+        seen_version = job->version;
+        return true;
+    }
+
+    bool is_job_finished(const std::string& id) {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        auto it = jobs.find(id);
+        return it == jobs.end() || is_finished(it->second->state);
+    }
+
+    // Position 0 means running, -1 means not queued
+    int position(std::string id) {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        auto it = jobs.find(id);
+        if (it != jobs.end() && !it->second->collapsed_into.empty()) {
+            id = it->second->collapsed_into;  // followers wait in their leader's place
+        }
+        for (auto& job : running) {
+            if (job->id == id) {
+                return 0;
+            }
+        }
+        for (size_t i = 0; i < pending.size(); ++i) {
+            if (pending[i]->id == id) {
+                return static_cast<int>(i) + 1;
+            }
+        }
+        return -1;
+    }
+
+    size_t queued() {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        return pending.size();
+    }
+
+    size_t capacity() const {
+        return max_queued;
+    }
+
+    bool busy() {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        return !running.empty();
+    }
+
+    std::string admission_to_json() {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        std::ostringstream out;
+        out << "{\"outstanding_mpx_steps\":" << outstanding_cost / 1e6
+            << ",\"budget_mpx_steps\":" << cost_budget / 1e6
+            << ",\"client_budget_mpx_steps\":" << client_cost_budget / 1e6
+            << ",\"throughput_mpx_steps_per_s\":" << throughput / 1e6
+            << ",\"clients\":" << client_cost.size()
+            << ",\"rejected\":" << rejected << "}";
+        return out.str();
+    }
+
+    std::string batching_to_json() {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        std::ostringstream out;
+        out << "{\"max_batch\":" << max_batch
+            << ",\"runs\":" << runs
+            << ",\"merged_jobs\":" << merged_jobs
+            << ",\"cancelled\":" << cancelled
+            << ",\"max_model_wait_ms\":" << max_model_wait.count()
+            << ",\"affinity_picks\":" << affinity_picks
+            << ",\"starvation_picks\":" << starvation_picks
+            << ",\"encode_threads\":" << n_encoders
+            << ",\"encoded_batches\":" << encoded_batches
+            << ",\"encode_ms\":" << encode_ms_total << "}";
+        return out.str();
+    }
+
+    // Serialize a job under the queue lock so fields are read consistently
+    std::string job_to_json(const std::string& id) {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        auto it = jobs.find(id);
+        if (it == jobs.end()) {
+            return "";
+        }
+        const GenerationJob& job = *it->second;
+        auto ms_between = [](std::chrono::steady_clock::time_point a,
+                             std::chrono::steady_clock::time_point b) {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(b - a).count();
+        };
+        auto now = std::chrono::steady_clock::now();
+
+        std::ostringstream out;
+        out << "{\"job_id\":\"" << json_escape(job.id) << "\""
+            << ",\"state\":\"" << job_state_to_string(job.state) << "\""
+            << ",\"priority\":" << job.params.priority
+            << ",\"model\":\"" << json_escape(job.model_path) << "\"";
+        if (job.from_cache) {
+            out << ",\"cached\":true";
+        }
+        if (!job.collapsed_into.empty()) {
+            out << ",\"collapsed_into\":\"" << json_escape(job.collapsed_into) << "\"";
+        }
+        if (job.state == JobState::QUEUED) {
+            const std::string& queued_id = job.collapsed_into.empty() ? job.id : job.collapsed_into;
+            int pos = 0;
+            for (size_t i = 0; i < pending.size(); ++i) {
+                if (pending[i]->id == queued_id) {
+                    pos = static_cast<int>(i) + 1;
+                    break;
+                }
+            }
+            out << ",\"queue_position\":" << pos
+                << ",\"wait_ms\":" << ms_between(job.submitted_at, now);
+        } else if (job.state == JobState::RUNNING) {
+            out << ",\"seed\":" << job.seed_used
+                << ",\"batched_with\":" << job.batched_with
+                << ",\"cancel_requested\":" << (job.cancel_requested ? "true" : "false")
+                << ",\"wait_ms\":" << ms_between(job.submitted_at, job.started_at)
+                << ",\"run_ms\":" << ms_between(job.started_at, now)
+                << ",\"phase\":\"" << (job.encoding ? "encoding" : job.decoding ? "decoding" : "sampling") << "\""
+                << ",\"step\":" << job.step
+                << ",\"steps\":" << job.total_steps;
+            if (job.step_samples > 0) {
+                float sec_per_step = job.step_time_sum / job.step_samples;
+                int remaining = job.decoding || job.encoding ? 0 : job.total_steps - job.step;
+                out << ",\"sec_per_step\":" << sec_per_step
+                    << ",\"eta_ms\":" << static_cast<int64_t>(sec_per_step * remaining * 1000.0f);
+            }
+        } else {
+            out << ",\"success\":" << (job.state == JobState::COMPLETED ? "true" : "false")
+                << ",\"filenames\":" << json_string_array(job.filenames)
+                << ",\"seed\":" << job.seed_used
+                << ",\"batched_with\":" << job.batched_with;
+            if (!job.error.empty()) {
+                out << ",\"error\":\"" << json_escape(job.error) << "\"";
+            }
+            if (job.started_at.time_since_epoch().count() != 0) {
+                out << ",\"wait_ms\":" << ms_between(job.submitted_at, job.started_at)
+                    << ",\"run_ms\":" << ms_between(job.started_at, job.finished_at);
+            }
+        }
+        out << "}";
+        return out.str();
+    }
+};
+
+// =================
+// HTTP SERVER
+// =================
+
+static httplib::Server* g_http_server = nullptr;
+
+static void signal_handler(int) {
+    if (g_http_server) {
+        g_http_server->stop();
+    }
+}
+
+// Accepts the library's own type names (f32, f16, q8_0, ...)
+static bool parse_weight_type(const std::string& name, sd_type_t& type) {
+    for (int t = 0; t < SD_TYPE_COUNT; ++t) {
+        const char* type_name = sd_type_name(static_cast<sd_type_t>(t));
+        if (type_name && name == type_name) {
+            type = static_cast<sd_type_t>(t);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void print_usage(const char* argv0) {
+    std::cout << "Usage: " << argv0 << " [options]\n"
+              << "  --host <addr>          listen address (default 0.0.0.0)\n"
+              << "  --port <port>          listen port (default 8080)\n"
+              << "  --model <path>         model to load at startup\n"
+              << "  --clip-l, --clip-g, --t5xxl, --vae <path>\n"
+              << "                         separate components of the startup model (--model is then the diffusion model)\n"
+              << "  --convert-threads <n>  weight cache conversions of a split model run in parallel (default 0 = one per file)\n"
+              << "  --queue-size <n>       max queued generation jobs (default 32)\n"
+              << "  --job-history <n>      finished jobs kept for polling (default 256)\n"
+              << "  --max-batch <n>        max images merged into one txt2img call (default 4)\n"
+              << "  --threads <n>          ggml threads of the generation context (default: physical cores)\n"
+              << "  --max-event-streams <n> concurrent /jobs/{id}/events streams (default: half the HTTP threads)\n"
+              << "  --cost-budget <n>      max outstanding work in megapixel-steps (default 200, 0 = unlimited)\n"
+              << "  --client-budget <n>    max outstanding work per client in megapixel-steps (default 100)\n"
+              << "  --http-queue <n>       max connections waiting for an HTTP worker (default 64)\n"
+              << "  --weight-type <type>   weight type models are converted to (default f16)\n"
+              << "  --weight-cache-dir <d> where converted weights are cached (default: next to the source)\n"
+              << "  --no-weight-cache      convert non-GGUF checkpoints on every load\n"
+              << "  --encode-threads <n>   threads encoding and writing PNGs after sampling (default 2, 0 = on the executor)\n"
+              << "  --png-compression <n>  default PNG deflate level, 5-9 (default 8; /generate png_compression overrides)\n"
+              << "  --png-threads <n>      row bands per PNG; n - 1 band threads are shared by all encoders\n"
+              << "                         (default: cores not used for sampling, 1 to 4)\n"
+              << "  --models-dir <dir>     directory in which /generate \"model\" names are looked up\n"
+              << "  --model-budget-mb <n>  RAM for resident models (default 0 = default model only)\n"
+              << "  --max-model-wait <s>   longest a job is overtaken by jobs for resident models (default 30, 0 = FIFO)\n"
+              << "  --warmup <buckets>     warm up WxH[xB] sizes at startup, e.g. 512x512,768x768x2\n"
+              << "  --result-cache-mb <n>  fixed-seed image cache size in MB (default 512, 0 = off)\n"
+              << "  --placement <mode>     none, compact (pin generation threads to cores) or numa (pin to one node, memory node-local)\n";
+}
+
+static void send_json(httplib::Response& res, int status, const std::string& body) {
+    res.status = status;
+    res.set_content(body, "application/json");
+}
+
+static void send_error(httplib::Response& res, int status, const std::string& message) {
+    send_json(res, status, "{\"success\":false,\"error\":\"" + json_escape(message) + "\"}");
+}
+
+int main(int argc, char** argv) {
+    std::string host = "0.0.0.0";
+    int port = 8080;
+    std::string initial_model;
+    size_t queue_size = 32;
+    size_t job_history = 256;
+    int max_batch = 4;
+    int n_threads = -1;
+    int max_event_streams = std::max(1, static_cast<int>(CPPHTTPLIB_THREAD_POOL_COUNT) / 2);
+    double cost_budget_mpx = 200.0;
+    double client_budget_mpx = 100.0;
+    size_t http_queue = 64;
+    CpuPlacement::Mode placement_mode = CpuPlacement::Mode::NONE;
+    size_t result_cache_mb = 512;
+    size_t model_budget_mb = 0;
+    double max_model_wait = 30.0;
+    std::string models_dir;
+    sd_type_t weight_type = SD_TYPE_F16;
+    ModelComponents initial_components;
+    std::vector<WarmupBucket> warmup_buckets;
+    int convert_threads = 0;
+    std::string weight_cache_dir;
+    bool weight_cache = true;
+    int encode_threads = 2;
+    int png_compression = 8;
+    int png_threads = 0;  // 0: cores left over by sampling
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto next = [&](const char* name) -> std::string {
+            if (i + 1 >= argc) {
+                std::cerr << "Missing value for " << name << std::endl;
+                exit(1);
+            }
+            return argv[++i];
+        };
+        if (arg == "--host") {
+            host = next("--host");
+        } else if (arg == "--port") {
+            port = std::stoi(next("--port"));
+        } else if (arg == "--model") {
+            initial_model = next("--model");
+        } else if (arg == "--queue-size") {
+            queue_size = static_cast<size_t>(std::max(1, std::stoi(next("--queue-size"))));
+        } else if (arg == "--job-history") {
+            job_history = static_cast<size_t>(std::max(1, std::stoi(next("--job-history"))));
+        } else if (arg == "--max-batch") {
+            max_batch = std::max(1, std::stoi(next("--max-batch")));
+        } else if (arg == "--threads") {
+            n_threads = std::max(1, std::stoi(next("--threads")));
+        } else if (arg == "--max-event-streams") {
+            max_event_streams = std::max(0, std::stoi(next("--max-event-streams")));
+        } else if (arg == "--cost-budget") {
+            cost_budget_mpx = std::max(0.0, std::stod(next("--cost-budget")));
+        } else if (arg == "--client-budget") {
+            client_budget_mpx = std::max(0.0, std::stod(next("--client-budget")));
+        } else if (arg == "--http-queue") {
+            http_queue = static_cast<size_t>(std::max(0, std::stoi(next("--http-queue"))));
+        } else if (arg == "--clip-l") {
+            initial_components.clip_l = next("--clip-l");
+        } else if (arg == "--clip-g") {
+            initial_components.clip_g = next("--clip-g");
+        } else if (arg == "--t5xxl") {
+            initial_components.t5xxl = next("--t5xxl");
+        } else if (arg == "--vae") {
+            initial_components.vae = next("--vae");
+        } else if (arg == "--convert-threads") {
+            convert_threads = std::max(0, std::stoi(next("--convert-threads")));
+        } else if (arg == "--warmup") {
+            std::string spec = next("--warmup");
+            if (!parse_warmup_buckets(spec, warmup_buckets)) {
+                std::cerr << "Invalid warm-up buckets: " << spec << std::endl;
+                return 1;
+            }
+        } else if (arg == "--weight-type") {
+            std::string name = next("--weight-type");
+            if (!parse_weight_type(name, weight_type)) {
+                std::cerr << "Unknown weight type: " << name << std::endl;
+                return 1;
+            }
+        } else if (arg == "--weight-cache-dir") {
+            weight_cache_dir = next("--weight-cache-dir");
+        } else if (arg == "--no-weight-cache") {
+            weight_cache = false;
+        } else if (arg == "--encode-threads") {
+            encode_threads = std::max(0, std::stoi(next("--encode-threads")));
+        } else if (arg == "--png-compression") {
+            png_compression = std::stoi(next("--png-compression"));
+            if (png_compression < 5 || png_compression > 9) {
+                std::cerr << "--png-compression must be between 5 and 9" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--png-threads") {
+            png_threads = std::max(1, std::stoi(next("--png-threads")));
+        } else if (arg == "--models-dir") {
+            models_dir = next("--models-dir");
+        } else if (arg == "--max-model-wait") {
+            max_model_wait = std::max(0.0, std::stod(next("--max-model-wait")));
+        } else if (arg == "--model-budget-mb") {
+            model_budget_mb = static_cast<size_t>(std::max(0, std::stoi(next("--model-budget-mb"))));
+        } else if (arg == "--result-cache-mb") {
+            result_cache_mb = static_cast<size_t>(std::max(0, std::stoi(next("--result-cache-mb"))));
+        } else if (arg == "--placement") {
+            std::string mode = next("--placement");
+            if (!CpuPlacement::parse_mode(mode, placement_mode)) {
+                std::cerr << "Unknown placement mode: " << mode << std::endl;
+                return 1;
+            }
+        } else if (arg == "-h" || arg == "--help") {
+            print_usage(argv[0]);
+            return 0;
+        } else {
+            std::cerr << "Unknown argument: " << arg << std::endl;
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // Without --threads the placement takes every physical core it allows
+    CpuPlacement placement;
+    placement.plan(placement_mode, n_threads);
+    if (n_threads <= 0) {
+        n_threads = placement.cpu_count() > 0 ? placement.cpu_count()
+                                              : std::max(1, get_num_physical_cores());
+    }
+    std::cout << "Generation threads: " << n_threads << std::endl;
+
+    // Loads and generations run on placed threads only; the HTTP threads
+    // keep the process-wide affinity
+    StableDiffusionServer sd_server(n_threads);
+    sd_server.set_thread_init([&placement] { placement.apply(); });
+    sd_server.set_models_dir(models_dir);
+    sd_server.set_weight_type(weight_type);
+    sd_server.set_weight_cache(weight_cache, weight_cache_dir);
+    sd_server.set_convert_threads(convert_threads);
+    sd_server.set_memory_budget(model_budget_mb * 1024 * 1024);
+    if (!initial_model.empty()) {
+        sd_server.load_model(initial_model, initial_components);
+        // Before listening, so the first request at these sizes is not the slow one
+        if (!warmup_buckets.empty()) {
+            sd_server.warm_up("", warmup_buckets);
+        }
+        sd_server.note_startup_ready();
+    }
+
+    // Band threads get the cores sampling leaves free, so encoding the last
+    // batch does not slow down sampling of the next one
+    if (png_threads <= 0) {
+        int spare = static_cast<int>(std::thread::hardware_concurrency()) - n_threads;
+        png_threads = std::max(1, std::min(4, spare));
+    }
+    PngBandPool png_band_pool(png_threads - 1);
+    ResultCache result_cache(result_cache_mb * 1024 * 1024);
+    JobQueue job_queue(queue_size, job_history, max_batch);
+    job_queue.set_cost_budget(cost_budget_mpx * 1e6, client_budget_mpx * 1e6);
+    job_queue.set_model_affinity([&sd_server](const std::string& model) {
+        return sd_server.is_model_ready(model);
+    }, std::chrono::milliseconds(static_cast<int64_t>(max_model_wait * 1000)));
+    job_queue.set_result_cache(&result_cache);
+    job_queue.set_encoder([&sd_server, png_threads, &png_band_pool](GenerationResult& result) {
+        StableDiffusionServer::encode_images(result, png_threads, png_band_pool);
+        for (const auto& image : result.images) {
+            if (!image.filename.empty()) {
+                sd_server.note_image_served();
+                break;
+            }
+        }
+    }, encode_threads);
+    job_queue.start([&sd_server](const GenerationParams& p) {
+        // Jobs whose named model was not resident at submit load it here
+        auto model = p.model ? p.model : sd_server.acquire_model(p.model_path);
+        return sd_server.generate_image(model, p.prompt, p.negative_prompt, p.width, p.height,
+                                        p.steps, p.cfg_scale, p.seed, p.batch_count);
+    }, [&placement] { placement.apply(); });
+    sd_set_progress_callback(&JobQueue::on_progress, &job_queue);
+
+    // An event stream holds an HTTP worker thread until its job finishes.
+    // Streams past the cap are refused so the pool keeps threads for
+    // /status and polling; refused clients poll /jobs/{id} instead.
+    std::atomic<int> event_streams{0};
+
+    httplib::Server svr;
+    // Bound connections waiting for an HTTP worker so overload fails fast
+    svr.new_task_queue = [http_queue] {
+        return new httplib::ThreadPool(CPPHTTPLIB_THREAD_POOL_COUNT, http_queue);
+    };
+    g_http_server = &svr;
+    std::signal(SIGINT, signal_handler);
+    std::signal(SIGTERM, signal_handler);
+
+    svr.Get("/status", [&](const httplib::Request&, httplib::Response& res) {
+        std::ostringstream out;
+        out << "{\"status\":\"ok\""
+            << ",\"model_loaded\":" << (sd_server.is_model_loaded() ? "true" : "false")
+            << ",\"model_path\":\"" << json_escape(sd_server.get_model_path()) << "\""
+            << ",\"loading\":\"" << json_escape(sd_server.get_loading_path()) << "\""
+            << ",\"last_load_error\":\"" << json_escape(sd_server.get_last_load_error()) << "\""
+            << ",\"models\":" << sd_server.models_to_json()
+            << ",\"startup\":" << sd_server.startup_to_json()
+            << ",\"warmup\":" << sd_server.last_warmup_to_json()
+            << ",\"queue\":{\"queued\":" << job_queue.queued()
+            << ",\"capacity\":" << job_queue.capacity()
+            << ",\"running\":" << (job_queue.busy() ? "true" : "false") << "}"
+            << ",\"threads\":" << sd_server.get_threads()
+            << ",\"placement\":" << placement.to_json()
+            << ",\"event_streams\":{\"open\":" << event_streams.load()
+            << ",\"max\":" << max_event_streams << "}"
+            << ",\"batching\":" << job_queue.batching_to_json()
+            << ",\"admission\":" << job_queue.admission_to_json()
+            << ",\"result_cache\":" << result_cache.to_json() << "}";
+        send_json(res, 200, out.str());
+    });
+
+    svr.Post("/load_model", [&](const httplib::Request& req, httplib::Response& res) {
+        JsonObject body;
+        if (!body.parse(req.body) || body.get_string("model_path").empty()) {
+            send_error(res, 400, "model_path is required");
+            return;
+        }
+        std::string path = body.get_string("model_path");
+        // Split models (SD3, Flux): model_path is then the diffusion model
+        ModelComponents components;
+        components.clip_l = body.get_string("clip_l");
+        components.clip_g = body.get_string("clip_g");
+        components.t5xxl  = body.get_string("t5xxl");
+        components.vae    = body.get_string("vae");
+        if (!sd_server.get_loading_path().empty()) {
+            send_error(res, 409, "Another model is loading: " + sd_server.get_loading_path());
+            return;
+        }
+        // The current model keeps serving while the new one loads
+        if (body.get_bool("async")) {
+            if (!sd_server.load_model_async(path, components)) {
+                send_error(res, 409, "Another model is loading");
+                return;
+            }
+            send_json(res, 202, "{\"success\":true,\"loading\":\"" + json_escape(path) + "\"}");
+            return;
+        }
+        if (!sd_server.load_model(path, components)) {
+            std::string error = sd_server.get_last_load_error();
+            send_error(res, 500, error.empty() ? "Failed to load model: " + path : error);
+            return;
+        }
+        send_json(res, 200, "{\"success\":true,\"model_path\":\"" + json_escape(path) + "\"}");
+    });
+
+    // Run the given sizes (or the --warmup ones) once now
+    svr.Post("/warmup", [&](const httplib::Request& req, httplib::Response& res) {
+        JsonObject body;
+        if (!req.body.empty() && !body.parse(req.body)) {
+            send_error(res, 400, "Invalid JSON");
+            return;
+        }
+        std::vector<WarmupBucket> buckets = warmup_buckets;
+        std::string spec = body.get_string("buckets");
+        if (!spec.empty()) {
+            buckets.clear();
+            if (!parse_warmup_buckets(spec, buckets)) {
+                send_error(res, 400, "buckets must look like 512x512,768x768x2");
+                return;
+            }
+        }
+        if (buckets.empty()) {
+            send_error(res, 400, "buckets is required when --warmup is not set");
+            return;
+        }
+        std::string model;
+        if (!sd_server.resolve_model(body.get_string("model"), model)) {
+            send_error(res, 404, "Unknown model: " + body.get_string("model"));
+            return;
+        }
+        if (model.empty() && !sd_server.is_model_loaded()) {
+            send_error(res, 503, "Model not loaded");
+            return;
+        }
+        auto started = std::chrono::steady_clock::now();
+        auto report = sd_server.warm_up(model, buckets);
+        auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                              std::chrono::steady_clock::now() - started).count();
+        if (report.empty()) {
+            send_error(res, 500, "Warm-up failed");
+            return;
+        }
+        send_json(res, 200, "{\"success\":true,\"total_ms\":" + std::to_string(elapsed_ms) +
+                            ",\"buckets\":" + StableDiffusionServer::warmup_to_json(report) + "}");
+    });
+
+    svr.Post("/generate", [&](const httplib::Request& req, httplib::Response& res) {
+        JsonObject body;
+        if (!body.parse(req.body)) {
+            send_error(res, 400, "Invalid JSON");
+            return;
+        }
+        GenerationParams params;
+        params.prompt          = body.get_string("prompt");
+        params.negative_prompt = body.get_string("negative_prompt");
+        params.width           = static_cast<int>(body.get_int("width", params.width));
+        params.height          = static_cast<int>(body.get_int("height", params.height));
+        params.steps           = static_cast<int>(body.get_int("steps", params.steps));
+        params.cfg_scale       = body.get_float("cfg_scale", params.cfg_scale);
+        params.seed            = static_cast<int>(body.get_int("seed", params.seed));
+        params.batch_count     = static_cast<int>(body.get_int("batch_count", params.batch_count));
+        params.priority        = static_cast<int>(body.get_int("priority", params.priority));
+        params.png_compression = static_cast<int>(body.get_int("png_compression", png_compression));
+
+        if (params.prompt.empty()) {
+            send_error(res, 400, "prompt is required");
+            return;
+        }
+        if (params.width <= 0 || params.height <= 0 || params.width % 8 || params.height % 8 ||
+            params.steps <= 0 || params.batch_count <= 0) {
+            send_error(res, 400, "width/height must be positive multiples of 8, steps and batch_count positive");
+            return;
+        }
+        if (params.png_compression < 5 || params.png_compression > 9) {
+            send_error(res, 400, "png_compression must be between 5 and 9");
+            return;
+        }
+        if (!sd_server.resolve_model(body.get_string("model"), params.model_path)) {
+            send_error(res, 404, "Unknown model: " + body.get_string("model"));
+            return;
+        }
+        // Pin the job to its model when that is resident, so a load_model
+        // swap or an eviction while it is queued does not move or drop it.
+        // A named model that is not resident is loaded when the job runs.
+        params.model = params.model_path.empty() ? sd_server.acquire_model()
+                                                 : sd_server.resident_model(params.model_path);
+        if (!params.model && params.model_path.empty()) {
+            send_error(res, 503, "Model not loaded");
+            return;
+        }
+
+        JobQueue::Rejection rejection;
+        auto job = job_queue.submit(params, req.remote_addr, rejection);
+        if (!job) {
+            if (rejection.retry_after > 0) {
+                res.set_header("Retry-After", std::to_string(rejection.retry_after));
+            }
+            send_error(res, rejection.status, rejection.reason);
+            return;
+        }
+
+        // Cache hits are already complete and answered with the finished job
+        if (job->from_cache) {
+            send_json(res, 200, job_queue.job_to_json(job->id));
+            return;
+        }
+
+        std::ostringstream out;
+        out << "{\"success\":true,\"job_id\":\"" << json_escape(job->id) << "\""
+            << ",\"status_url\":\"/jobs/" << json_escape(job->id) << "\""
+            << ",\"queue_position\":" << job_queue.position(job->id) << "}";
+        send_json(res, 202, out.str());
+    });
+
+    svr.Get(R"(/jobs/([A-Za-z0-9\-]+))", [&](const httplib::Request& req, httplib::Response& res) {
+        std::string body = job_queue.job_to_json(req.matches[1]);
+        if (body.empty()) {
+            send_error(res, 404, "Unknown job");
+            return;
+        }
+        send_json(res, 200, body);
+    });
+
+    auto cancel_handler = [&](const httplib::Request& req, httplib::Response& res) {
+        std::string id = req.matches[1];
+        if (!job_queue.cancel(id)) {
+            std::string body = job_queue.job_to_json(id);
+            if (body.empty()) {
+                send_error(res, 404, "Unknown job");
+            } else {
+                send_json(res, 409, body);
+            }
+            return;
+        }
+        send_json(res, 200, job_queue.job_to_json(id));
+    };
+    svr.Post(R"(/jobs/([A-Za-z0-9\-]+)/cancel)", cancel_handler);
+
+    // Server-Sent Events: one "progress" event per state/step change, then
+    // a final "done" event carrying the finished job
+    svr.Get(R"(/jobs/([A-Za-z0-9\-]+)/events)", [&](const httplib::Request& req, httplib::Response& res) {
+        std::string id = req.matches[1];
+        if (job_queue.job_to_json(id).empty()) {
+            send_error(res, 404, "Unknown job");
+            return;
+        }
+        if (++event_streams > max_event_streams) {
+            --event_streams;
+            send_error(res, 503, "Too many event streams, poll /jobs/" + id + " instead");
+            return;
+        }
+        res.set_header("Cache-Control", "no-cache");
+        auto seen_version = std::make_shared<uint64_t>(UINT64_MAX);
+        res.set_chunked_content_provider("text/event-stream",
+            [&job_queue, id, seen_version](size_t, httplib::DataSink& sink) {
+                std::string event;
+                if (job_queue.wait_for_update(id, *seen_version, std::chrono::seconds(15))) {
+                    bool finished = job_queue.is_job_finished(id);
+                    event = std::string("event: ") + (finished ? "done" : "progress") +
+                            "\ndata: " + job_queue.job_to_json(id) + "\n\n";
+                    if (!sink.write(event.data(), event.size())) {
+                        return false;
+                    }
+                    if (finished) {
+                        sink.done();
+                    }
+                    return true;
+                }
+                if (job_queue.is_job_finished(id)) {
+                    sink.done();
+                    return true;
+                }
+                // Keep idle connections (long queue waits) open through proxies
+                event = ": keepalive\n\n";
+                return sink.write(event.data(), event.size());
+            },
+            [&event_streams](bool) { --event_streams; });
+    });
+    svr.Delete(R"(/jobs/([A-Za-z0-9\-]+))", cancel_handler);
+
+    svr.Get(R"(/image/([A-Za-z0-9_\-\.]+\.png))", [&](const httplib::Request& req, httplib::Response& res) {
+        std::string filename = req.matches[1];
+        if (filename.find("..") != std::string::npos) {
+            send_error(res, 400, "Invalid filename");
+            return;
+        }
+        std::ifstream file(filename, std::ios::binary);
+        if (!file) {
+            send_error(res, 404, "Image not found");
+            return;
+        }
+        std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        res.set_content(data, "image/png");
+    });
+
+    std::cout << "Server listening on " << host << ":" << port << std::endl;
+    if (!svr.listen(host, port)) {
+        std::cerr << "Failed to listen on " << host << ":" << port << std::endl;
+    }
+
+    g_http_server = nullptr;
+    job_queue.stop();
+    return 0;
+}
@@ -69,6 +69,31 @@ USAGE:
       int stbi_write_png_compression_level;    // defaults to 8; set to higher for more compression
       int stbi_write_force_png_filter;         // defaults to -1; set to 0..5 to force a filter mode
 
+   The PNG writers also come in re-entrant variants that take their settings
+   per call instead of from the globals above and stbi_flip_vertically_on_write,
+   so threads can encode concurrently with different settings:
+
+     void stbi_write_png_default_options(stbi_write_png_options *options);
+     int stbi_write_png_ex(char const *filename, int w, int h, int comp, const void *data, int stride_in_bytes, const stbi_write_png_options *options);
+     int stbi_write_png_to_func_ex(stbi_write_func *func, void *context, int w, int h, int comp, const void *data, int stride_in_bytes, const stbi_write_png_options *options);
+     unsigned char *stbi_write_png_to_mem_ex(const unsigned char *pixels, int stride_in_bytes, int w, int h, int comp, int *out_len, const stbi_write_png_options *options);
+
+   A NULL options pointer means the defaults (level 8, adaptive filter, no flip,
+   one band).
+
+   PNG row filters and the per-row filter heuristic use SSE2 (x86), AVX2 (x86,
+   when the CPU supports it at run time) or NEON (AArch64). The output is
+   byte-identical to the scalar code. Define STBIW_NO_SIMD to use the scalar
+   code only, or STBIW_NO_AVX2 to stop at SSE2.
+
+   With options->bands > 1 the image is split into that many row bands, each
+   filtered and deflated on its own (through options->parallel_for, if set,
+   so bands can run on several threads). The band streams are joined with
+   zlib sync flushes into a single IDAT and their Adler-32 checksums are
+   combined, so the result is a standard PNG, slightly larger than the
+   single-band one because matches never cross a band boundary. Bands are
+   ignored when STBIW_ZLIB_COMPRESS is defined.
+
 
    You can define STBI_WRITE_NO_STDIO to disable the file variant of these
    functions, so the library will not use stdio.h at all. However, this will
@@ -166,6 +191,21 @@ LICENSE
 #endif
 #endif
 
+// Per-call PNG settings for the *_ex writers; read-only during the call
+typedef struct
+{
+   int compression_level;  // deflate effort, 8 by default; values below 5 act as 5
+   int force_filter;       // -1 picks the best filter per row; 0..4 forces one
+   int flip_vertically;    // non-zero writes the last row first
+
+   // Row bands deflated independently; 0 or 1 encodes the image as one stream
+   int bands;
+   // Runs task(arg, i) for every i in [0, count) and returns once all are
+   // done, e.g. on a thread pool. NULL runs the bands one after another.
+   void (*parallel_for)(void *context, int count, void (*task)(void *arg, int index), void *arg);
+   void *parallel_context;
+} stbi_write_png_options;
+
 #ifndef STB_IMAGE_WRITE_STATIC  // C++ forbids static forward declarations
 STBIWDEF int stbi_write_tga_with_rle;
 STBIWDEF int stbi_write_png_compression_level;
@@ -174,6 +214,7 @@ STBIWDEF int stbi_write_force_png_filter;
 
 #ifndef STBI_WRITE_NO_STDIO
 STBIWDEF int stbi_write_png(char const *filename, int w, int h, int comp, const void  *data, int stride_in_bytes);
+STBIWDEF int stbi_write_png_ex(char const *filename, int w, int h, int comp, const void  *data, int stride_in_bytes, const stbi_write_png_options *options);
 STBIWDEF int stbi_write_bmp(char const *filename, int w, int h, int comp, const void  *data);
 STBIWDEF int stbi_write_tga(char const *filename, int w, int h, int comp, const void  *data);
 STBIWDEF int stbi_write_hdr(char const *filename, int w, int h, int comp, const float *data);
@@ -187,6 +228,9 @@ STBIWDEF int stbiw_convert_wchar_to_utf8(char *buffer, size_t bufferlen, const w
 typedef void stbi_write_func(void *context, void *data, int size);
 
 STBIWDEF int stbi_write_png_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void  *data, int stride_in_bytes);
+STBIWDEF int stbi_write_png_to_func_ex(stbi_write_func *func, void *context, int w, int h, int comp, const void  *data, int stride_in_bytes, const stbi_write_png_options *options);
+STBIWDEF unsigned char *stbi_write_png_to_mem_ex(const unsigned char *pixels, int stride_in_bytes, int w, int h, int comp, int *out_len, const stbi_write_png_options *options);
+STBIWDEF void stbi_write_png_default_options(stbi_write_png_options *options);
 STBIWDEF int stbi_write_bmp_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void  *data);
 STBIWDEF int stbi_write_tga_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void  *data);
 STBIWDEF int stbi_write_hdr_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const float *data);
@@ -216,6 +260,27 @@ STBIWDEF void stbi_flip_vertically_on_write(int flip_boolean);
 #include <string.h>
 #include <math.h>
 
+#ifndef STBIW_NO_SIMD
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define STBIW_SSE2
+#include <emmintrin.h>
+#if !defined(STBIW_NO_AVX2) && (defined(_MSC_VER) || defined(__GNUC__) || defined(__clang__))
+#define STBIW_AVX2
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define STBIW__TARGET_AVX2
+#else
+#define STBIW__TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+#endif
+#if defined(__aarch64__) || defined(_M_ARM64)
+#define STBIW_NEON
+#include <arm_neon.h>
+#endif
+#endif // STBIW_NO_SIMD
+
 #if defined(STBIW_MALLOC) && defined(STBIW_FREE) && (defined(STBIW_REALLOC) || defined(STBIW_REALLOC_SIZED))
 // ok
 #elif !defined(STBIW_MALLOC) && !defined(STBIW_FREE) && !defined(STBIW_REALLOC) && !defined(STBIW_REALLOC_SIZED)
@@ -892,27 +957,27 @@ static unsigned int stbiw__zhash(unsigned char *data)
 
 #endif // STBIW_ZLIB_COMPRESS
 
-STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+#ifndef STBIW_ZLIB_COMPRESS
+// Raw DEFLATE of data[0..data_len) appended to *dest, ending byte aligned.
+// A non-final band ends with an empty stored block (a zlib sync flush), so
+// the next band can follow as a new block; matches never reach into earlier
+// bands. Returns 0, leaving *dest untouched, if out of memory.
+static int stbiw__zlib_deflate_band(unsigned char **dest, unsigned char *data, int data_len, int quality, int final)
 {
-#ifdef STBIW_ZLIB_COMPRESS
-   // user provided a zlib compress implementation, use that
-   return STBIW_ZLIB_COMPRESS(data, data_len, out_len, quality);
-#else // use builtin
    static unsigned short lengthc[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
    static unsigned char  lengtheb[]= { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
    static unsigned short distc[]   = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 32768 };
    static unsigned char  disteb[]  = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
    unsigned int bitbuf=0;
    int i,j, bitcount=0;
-   unsigned char *out = NULL;
+   unsigned char *out = *dest;
+   int start = stbiw__sbcount(out);
    unsigned char ***hash_table = (unsigned char***) STBIW_MALLOC(stbiw__ZHASH * sizeof(unsigned char**));
    if (hash_table == NULL)
-      return NULL;
+      return 0;
    if (quality < 5) quality = 5;
 
-   stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
-   stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
-   stbiw__zlib_add(1,1);  // BFINAL = 1
+   stbiw__zlib_add(final ? 1 : 0,1);  // BFINAL
    stbiw__zlib_add(1,2);  // BTYPE = 1 -- fixed huffman
 
    for (i=0; i < stbiw__ZHASH; ++i)
@@ -973,21 +1038,29 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
    for (;i < data_len; ++i)
       stbiw__zlib_huffb(data[i]);
    stbiw__zlib_huff(256); // end of block
+   if (!final)
+      stbiw__zlib_add(0,3);  // BFINAL = 0, BTYPE = 0 -- empty stored block follows
    // pad with 0 bits to byte boundary
    while (bitcount)
       stbiw__zlib_add(0,1);
+   if (!final) {
+      stbiw__sbpush(out, 0x00); // LEN = 0
+      stbiw__sbpush(out, 0x00);
+      stbiw__sbpush(out, 0xff); // NLEN
+      stbiw__sbpush(out, 0xff);
+   }
 
    for (i=0; i < stbiw__ZHASH; ++i)
       (void) stbiw__sbfree(hash_table[i]);
    STBIW_FREE(hash_table);
 
    // store uncompressed instead if compression was worse
-   if (stbiw__sbn(out) > data_len + 2 + ((data_len+32766)/32767)*5) {
-      stbiw__sbn(out) = 2;  // truncate to DEFLATE 32K window and FLEVEL = 1
+   if (stbiw__sbn(out) - start > data_len + ((data_len+32766)/32767)*5) {
+      stbiw__sbn(out) = start;
       for (j = 0; j < data_len;) {
          int blocklen = data_len - j;
          if (blocklen > 32767) blocklen = 32767;
-         stbiw__sbpush(out, data_len - j == blocklen); // BFINAL = ?, BTYPE = 0 -- no compression
+         stbiw__sbpush(out, final && data_len - j == blocklen); // BFINAL = ?, BTYPE = 0 -- no compression
          stbiw__sbpush(out, STBIW_UCHAR(blocklen)); // LEN
          stbiw__sbpush(out, STBIW_UCHAR(blocklen >> 8));
          stbiw__sbpush(out, STBIW_UCHAR(~blocklen)); // NLEN
@@ -997,27 +1070,65 @@ STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, i
          j += blocklen;
       }
    }
+   *dest = out;
+   return 1;
+}
 
-   {
-      // compute adler32 on input
-      unsigned int s1=1, s2=0;
-      int blocklen = (int) (data_len % 5552);
-      j=0;
-      while (j < data_len) {
-         for (i=0; i < blocklen; ++i) { s1 += data[j+i]; s2 += s1; }
-         s1 %= 65521; s2 %= 65521;
-         j += blocklen;
-         blocklen = 5552;
-      }
-      stbiw__sbpush(out, STBIW_UCHAR(s2 >> 8));
-      stbiw__sbpush(out, STBIW_UCHAR(s2));
-      stbiw__sbpush(out, STBIW_UCHAR(s1 >> 8));
-      stbiw__sbpush(out, STBIW_UCHAR(s1));
+static unsigned int stbiw__adler32(unsigned char *data, int data_len)
+{
+   unsigned int s1=1, s2=0;
+   int i, j=0, blocklen = (int) (data_len % 5552);
+   while (j < data_len) {
+      for (i=0; i < blocklen; ++i) { s1 += data[j+i]; s2 += s1; }
+      s1 %= 65521; s2 %= 65521;
+      j += blocklen;
+      blocklen = 5552;
    }
+   return (s2 << 16) | s1;
+}
+
+// Adler-32 of A followed by B, from those of A and B and the length of B
+static unsigned int stbiw__adler32_combine(unsigned int adler1, unsigned int adler2, unsigned int len2)
+{
+   unsigned int base = 65521, rem = len2 % base;
+   unsigned int sum1 = adler1 & 0xffff;
+   unsigned int sum2 = (rem * sum1) % base;
+   sum1 += (adler2 & 0xffff) + base - 1;
+   sum2 += (adler1 >> 16) + (adler2 >> 16) + base - rem;
+   if (sum1 >= base) sum1 -= base;
+   if (sum1 >= base) sum1 -= base;
+   if (sum2 >= (base << 1)) sum2 -= (base << 1);
+   if (sum2 >= base) sum2 -= base;
+   return sum1 | (sum2 << 16);
+}
+
+static unsigned char *stbiw__zlib_finish(unsigned char *out, unsigned int adler, int *out_len)
+{
+   stbiw__sbpush(out, STBIW_UCHAR(adler >> 24));
+   stbiw__sbpush(out, STBIW_UCHAR(adler >> 16));
+   stbiw__sbpush(out, STBIW_UCHAR(adler >> 8));
+   stbiw__sbpush(out, STBIW_UCHAR(adler));
    *out_len = stbiw__sbn(out);
    // make returned pointer freeable
    STBIW_MEMMOVE(stbiw__sbraw(out), out, *out_len);
    return (unsigned char *) stbiw__sbraw(out);
+}
+#endif // STBIW_ZLIB_COMPRESS
+
+STBIWDEF unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+{
+#ifdef STBIW_ZLIB_COMPRESS
+   // user provided a zlib compress implementation, use that
+   return STBIW_ZLIB_COMPRESS(data, data_len, out_len, quality);
+#else // use builtin
+   unsigned char *out = NULL;
+   stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
+   stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
+   if (!stbiw__zlib_deflate_band(&out, data, data_len, quality, 1)) {
+      (void) stbiw__sbfree(out);
+      return NULL;
+   }
+   return stbiw__zlib_finish(out, stbiw__adler32(data, data_len), out_len);
 #endif // STBIW_ZLIB_COMPRESS
 }
 
@@ -1088,16 +1199,226 @@ static unsigned char stbiw__paeth(int a, int b, int c)
    return STBIW_UCHAR(c);
 }
 
+// SIMD row filters. Each kernel filters bytes [i, len) of a row that has a
+// row above it (PNG filter types 1-4, i >= n) and returns the index it
+// stopped at; the scalar loop finishes the tail. Results match the scalar code exactly.
+enum { STBIW__SIMD_NONE, STBIW__SIMD_SSE2, STBIW__SIMD_AVX2, STBIW__SIMD_NEON };
+
+static int stbiw__simd_level(void)
+{
+#if defined(STBIW_AVX2)
+#if defined(_MSC_VER) && !defined(__clang__)
+   int info[4];
+   __cpuid(info, 0);
+   if (info[0] >= 7) {
+      __cpuid(info, 1);
+      // AVX, and the OS saves YMM state
+      if ((info[2] & (1<<27)) && (info[2] & (1<<28)) && (_xgetbv(0) & 6) == 6) {
+         __cpuidex(info, 7, 0);
+         if (info[1] & (1<<5))
+            return STBIW__SIMD_AVX2;
+      }
+   }
+#else
+   if (__builtin_cpu_supports("avx2"))
+      return STBIW__SIMD_AVX2;
+#endif
+#endif
+#if defined(STBIW_SSE2)
+   return STBIW__SIMD_SSE2;
+#elif defined(STBIW_NEON)
+   return STBIW__SIMD_NEON;
+#else
+   return STBIW__SIMD_NONE;
+#endif
+}
+
+#ifdef STBIW_SSE2
+// paeth(a,b,c) per byte: pa = |b-c|, pb = |a-c|, pc = |a+b-2c|, in 16 bits
+static __m128i stbiw__paeth_sse2_half(__m128i a, __m128i b, __m128i c)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i bc = _mm_sub_epi16(b, c), ac = _mm_sub_epi16(a, c), abc = _mm_add_epi16(bc, ac);
+   __m128i pa = _mm_max_epi16(bc, _mm_sub_epi16(zero, bc));
+   __m128i pb = _mm_max_epi16(ac, _mm_sub_epi16(zero, ac));
+   __m128i pc = _mm_max_epi16(abc, _mm_sub_epi16(zero, abc));
+   __m128i not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+   __m128i not_b = _mm_cmpgt_epi16(pb, pc);
+   __m128i bc_pick = _mm_or_si128(_mm_andnot_si128(not_b, b), _mm_and_si128(not_b, c));
+   return _mm_or_si128(_mm_andnot_si128(not_a, a), _mm_and_si128(not_a, bc_pick));
+}
+
+static int stbiw__filter_row_sse2(int type, const unsigned char *z, const unsigned char *up, int n, int i, int len, signed char *out)
+{
+   __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi8(1);
+   for (; i + 16 <= len; i += 16) {
+      __m128i x = _mm_loadu_si128((const __m128i *) (z+i));
+      __m128i a = _mm_loadu_si128((const __m128i *) (z+i-n));
+      __m128i b, r;
+      if (type == 1) { // the first row has no row above
+         _mm_storeu_si128((__m128i *) (out+i), _mm_sub_epi8(x, a));
+         continue;
+      }
+      b = _mm_loadu_si128((const __m128i *) (up+i));
+      switch (type) {
+         case 2: r = _mm_sub_epi8(x, b); break;
+         case 3: // (a+b)>>1: pavgb rounds up, so take back the carried low bit
+            r = _mm_sub_epi8(x, _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one)));
+            break;
+         default: {
+            __m128i c = _mm_loadu_si128((const __m128i *) (up+i-n));
+            __m128i lo = stbiw__paeth_sse2_half(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+            __m128i hi = stbiw__paeth_sse2_half(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+            r = _mm_sub_epi8(x, _mm_packus_epi16(lo, hi));
+         } break;
+      }
+      _mm_storeu_si128((__m128i *) (out+i), r);
+   }
+   return i;
+}
+
+// sum of |(signed char) v| over the first len bytes, from `*i` on; updates *i
+static int stbiw__row_cost_sse2(const signed char *v, int len, int *i)
+{
+   __m128i zero = _mm_setzero_si128(), sum = _mm_setzero_si128();
+   for (; *i + 16 <= len; *i += 16) {
+      __m128i x = _mm_loadu_si128((const __m128i *) (v + *i));
+      __m128i sign = _mm_cmpgt_epi8(zero, x);
+      __m128i abs8 = _mm_sub_epi8(_mm_xor_si128(x, sign), sign); // -128 becomes 128 unsigned
+      sum = _mm_add_epi64(sum, _mm_sad_epu8(abs8, zero));
+   }
+   return _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sum, sum));
+}
+#endif // STBIW_SSE2
+
+#ifdef STBIW_AVX2
+STBIW__TARGET_AVX2 static __m256i stbiw__paeth_avx2_half(__m256i a, __m256i b, __m256i c)
+{
+   __m256i bc = _mm256_sub_epi16(b, c), ac = _mm256_sub_epi16(a, c);
+   __m256i pa = _mm256_abs_epi16(bc);
+   __m256i pb = _mm256_abs_epi16(ac);
+   __m256i pc = _mm256_abs_epi16(_mm256_add_epi16(bc, ac));
+   __m256i not_a = _mm256_or_si256(_mm256_cmpgt_epi16(pa, pb), _mm256_cmpgt_epi16(pa, pc));
+   __m256i not_b = _mm256_cmpgt_epi16(pb, pc);
+   return _mm256_blendv_epi8(a, _mm256_blendv_epi8(b, c, not_b), not_a);
+}
+
+// unpack/pack work per 128-bit lane, so the byte order survives the round trip
+STBIW__TARGET_AVX2 static int stbiw__filter_row_avx2(int type, const unsigned char *z, const unsigned char *up, int n, int i, int len, signed char *out)
+{
+   __m256i zero = _mm256_setzero_si256(), one = _mm256_set1_epi8(1);
+   for (; i + 32 <= len; i += 32) {
+      __m256i x = _mm256_loadu_si256((const __m256i *) (z+i));
+      __m256i a = _mm256_loadu_si256((const __m256i *) (z+i-n));
+      __m256i b, r;
+      if (type == 1) { // the first row has no row above
+         _mm256_storeu_si256((__m256i *) (out+i), _mm256_sub_epi8(x, a));
+         continue;
+      }
+      b = _mm256_loadu_si256((const __m256i *) (up+i));
+      switch (type) {
+         case 2: r = _mm256_sub_epi8(x, b); break;
+         case 3:
+            r = _mm256_sub_epi8(x, _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), one)));
+            break;
+         default: {
+            __m256i c = _mm256_loadu_si256((const __m256i *) (up+i-n));
+            __m256i lo = stbiw__paeth_avx2_half(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero), _mm256_unpacklo_epi8(c, zero));
+            __m256i hi = stbiw__paeth_avx2_half(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero), _mm256_unpackhi_epi8(c, zero));
+            r = _mm256_sub_epi8(x, _mm256_packus_epi16(lo, hi));
+         } break;
+      }
+      _mm256_storeu_si256((__m256i *) (out+i), r);
+   }
+   return i;
+}
+
+STBIW__TARGET_AVX2 static int stbiw__row_cost_avx2(const signed char *v, int len, int *i)
+{
+   __m256i zero = _mm256_setzero_si256(), sum = _mm256_setzero_si256();
+   __m128i s;
+   for (; *i + 32 <= len; *i += 32) {
+      __m256i x = _mm256_loadu_si256((const __m256i *) (v + *i));
+      sum = _mm256_add_epi64(sum, _mm256_sad_epu8(_mm256_abs_epi8(x), zero)); // |-128| reads as 128 unsigned
+   }
+   s = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+   return _mm_cvtsi128_si32(s) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(s, s));
+}
+#endif // STBIW_AVX2
+
+#ifdef STBIW_NEON
+static uint8x16_t stbiw__paeth_neon(uint8x16_t a, uint8x16_t b, uint8x16_t c)
+{
+   uint16x8_t pa_lo = vabdl_u8(vget_low_u8(b), vget_low_u8(c)), pa_hi = vabdl_u8(vget_high_u8(b), vget_high_u8(c));
+   uint16x8_t pb_lo = vabdl_u8(vget_low_u8(a), vget_low_u8(c)), pb_hi = vabdl_u8(vget_high_u8(a), vget_high_u8(c));
+   uint16x8_t pc_lo = vabdq_u16(vaddl_u8(vget_low_u8(a), vget_low_u8(b)), vshll_n_u8(vget_low_u8(c), 1));
+   uint16x8_t pc_hi = vabdq_u16(vaddl_u8(vget_high_u8(a), vget_high_u8(b)), vshll_n_u8(vget_high_u8(c), 1));
+   uint8x16_t use_a = vcombine_u8(vmovn_u16(vandq_u16(vcleq_u16(pa_lo, pb_lo), vcleq_u16(pa_lo, pc_lo))),
+                                  vmovn_u16(vandq_u16(vcleq_u16(pa_hi, pb_hi), vcleq_u16(pa_hi, pc_hi))));
+   uint8x16_t use_b = vcombine_u8(vmovn_u16(vcleq_u16(pb_lo, pc_lo)), vmovn_u16(vcleq_u16(pb_hi, pc_hi)));
+   return vbslq_u8(use_a, a, vbslq_u8(use_b, b, c));
+}
+
+static int stbiw__filter_row_neon(int type, const unsigned char *z, const unsigned char *up, int n, int i, int len, signed char *out)
+{
+   for (; i + 16 <= len; i += 16) {
+      uint8x16_t x = vld1q_u8(z+i), a = vld1q_u8(z+i-n), b, r;
+      if (type == 1) { // the first row has no row above
+         vst1q_s8(out+i, vreinterpretq_s8_u8(vsubq_u8(x, a)));
+         continue;
+      }
+      b = vld1q_u8(up+i);
+      switch (type) {
+         case 2: r = vsubq_u8(x, b); break;
+         case 3: r = vsubq_u8(x, vhaddq_u8(a, b)); break; // halving add truncates like >>1
+         default: r = vsubq_u8(x, stbiw__paeth_neon(a, b, vld1q_u8(up+i-n))); break;
+      }
+      vst1q_s8(out+i, vreinterpretq_s8_u8(r));
+   }
+   return i;
+}
+
+static int stbiw__row_cost_neon(const signed char *v, int len, int *i)
+{
+   uint32x4_t sum = vdupq_n_u32(0);
+   for (; *i + 16 <= len; *i += 16) {
+      uint8x16_t abs8 = vreinterpretq_u8_s8(vabsq_s8(vld1q_s8(v + *i))); // |-128| reads as 128 unsigned
+      sum = vpadalq_u16(sum, vpaddlq_u8(abs8));
+   }
+   return (int) vaddvq_u32(sum);
+}
+#endif // STBIW_NEON
+
+// Filter heuristic: the sum of the filtered bytes as signed magnitudes
+static int stbiw__row_cost(const signed char *v, int len, int simd)
+{
+   int i = 0, est = 0;
+#ifdef STBIW_AVX2
+   if (simd == STBIW__SIMD_AVX2) est += stbiw__row_cost_avx2(v, len, &i);
+#endif
+#ifdef STBIW_SSE2
+   if (simd >= STBIW__SIMD_SSE2) est += stbiw__row_cost_sse2(v, len, &i);
+#endif
+#ifdef STBIW_NEON
+   if (simd == STBIW__SIMD_NEON) est += stbiw__row_cost_neon(v, len, &i);
+#endif
+   (void) simd;
+   for (; i < len; ++i) {
+      est += abs(v[i]);
+   }
+   return est;
+}
+
 // @OPTIMIZE: provide an option that always forces left-predict or paeth predict
-static void stbiw__encode_png_line(unsigned char *pixels, int stride_bytes, int width, int height, int y, int n, int filter_type, signed char *line_buffer)
+static void stbiw__encode_png_line(unsigned char *pixels, int stride_bytes, int width, int height, int y, int n, int filter_type, int flip, int simd, signed char *line_buffer)
 {
-   static int mapping[] = { 0,1,2,3,4 };
-   static int firstmap[] = { 0,1,0,5,6 };
-   int *mymap = (y != 0) ? mapping : firstmap;
+   static const int mapping[] = { 0,1,2,3,4 };
+   static const int firstmap[] = { 0,1,0,5,6 };
+   const int *mymap = (y != 0) ? mapping : firstmap;
    int i;
    int type = mymap[filter_type];
-   unsigned char *z = pixels + stride_bytes * (stbi__flip_vertically_on_write ? height-1-y : y);
-   int signed_stride = stbi__flip_vertically_on_write ? -stride_bytes : stride_bytes;
+   unsigned char *z = pixels + stride_bytes * (flip ? height-1-y : y);
+   int signed_stride = flip ? -stride_bytes : stride_bytes;
 
    if (type==0) {
       memcpy(line_buffer, z, width*n);
@@ -1115,56 +1436,52 @@ static void stbiw__encode_png_line(unsigned char *pixels, int stride_bytes, int
          case 6: line_buffer[i] = z[i]; break;
       }
    }
+   i = n;
+   if (type <= 4) { // the first-row types 5 and 6 stay scalar
+#ifdef STBIW_AVX2
+      if (simd == STBIW__SIMD_AVX2) i = stbiw__filter_row_avx2(type, z, z-signed_stride, n, i, width*n, line_buffer);
+#endif
+#ifdef STBIW_SSE2
+      if (simd >= STBIW__SIMD_SSE2) i = stbiw__filter_row_sse2(type, z, z-signed_stride, n, i, width*n, line_buffer);
+#endif
+#ifdef STBIW_NEON
+      if (simd == STBIW__SIMD_NEON) i = stbiw__filter_row_neon(type, z, z-signed_stride, n, i, width*n, line_buffer);
+#endif
+   }
+   (void) simd;
    switch (type) {
-      case 1: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - z[i-n]; break;
-      case 2: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - z[i-signed_stride]; break;
-      case 3: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - ((z[i-n] + z[i-signed_stride])>>1); break;
-      case 4: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - stbiw__paeth(z[i-n], z[i-signed_stride], z[i-signed_stride-n]); break;
-      case 5: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - (z[i-n]>>1); break;
-      case 6: for (i=n; i < width*n; ++i) line_buffer[i] = z[i] - stbiw__paeth(z[i-n], 0,0); break;
+      case 1: for (; i < width*n; ++i) line_buffer[i] = z[i] - z[i-n]; break;
+      case 2: for (; i < width*n; ++i) line_buffer[i] = z[i] - z[i-signed_stride]; break;
+      case 3: for (; i < width*n; ++i) line_buffer[i] = z[i] - ((z[i-n] + z[i-signed_stride])>>1); break;
+      case 4: for (; i < width*n; ++i) line_buffer[i] = z[i] - stbiw__paeth(z[i-n], z[i-signed_stride], z[i-signed_stride-n]); break;
+      case 5: for (; i < width*n; ++i) line_buffer[i] = z[i] - (z[i-n]>>1); break;
+      case 6: for (; i < width*n; ++i) line_buffer[i] = z[i] - stbiw__paeth(z[i-n], 0,0); break;
    }
 }
 
-STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
+// Filter rows [y0,y1) into filt, each as its filter type byte plus the filtered row
+static void stbiw__png_filter_rows(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int force_filter, int flip, int y0, int y1, unsigned char *filt, signed char *line_buffer)
 {
-   int force_filter = stbi_write_force_png_filter;
-   int ctype[5] = { -1, 0, 4, 2, 6 };
-   unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
-   unsigned char *out,*o, *filt, *zlib;
-   signed char *line_buffer;
-   int j,zlen;
-
-   if (stride_bytes == 0)
-      stride_bytes = x * n;
-
-   if (force_filter >= 5) {
-      force_filter = -1;
-   }
-
-   filt = (unsigned char *) STBIW_MALLOC((x*n+1) * y); if (!filt) return 0;
-   line_buffer = (signed char *) STBIW_MALLOC(x * n); if (!line_buffer) { STBIW_FREE(filt); return 0; }
-   for (j=0; j < y; ++j) {
+   int j, simd = stbiw__simd_level();
+   for (j=y0; j < y1; ++j) {
       int filter_type;
       if (force_filter > -1) {
          filter_type = force_filter;
-         stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, force_filter, line_buffer);
+         stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, force_filter, flip, simd, line_buffer);
       } else { // Estimate the best filter by running through all of them:
-         int best_filter = 0, best_filter_val = 0x7fffffff, est, i;
+         int best_filter = 0, best_filter_val = 0x7fffffff, est;
          for (filter_type = 0; filter_type < 5; filter_type++) {
-            stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, filter_type, line_buffer);
+            stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, filter_type, flip, simd, line_buffer);
 
             // Estimate the entropy of the line using this filter; the less, the better.
-            est = 0;
-            for (i = 0; i < x*n; ++i) {
-               est += abs((signed char) line_buffer[i]);
-            }
+            est = stbiw__row_cost(line_buffer, x*n, simd);
             if (est < best_filter_val) {
                best_filter_val = est;
                best_filter = filter_type;
             }
          }
          if (filter_type != best_filter) {  // If the last iteration already got us the best filter, don't redo it
-            stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, best_filter, line_buffer);
+            stbiw__encode_png_line((unsigned char*)(pixels), stride_bytes, x, y, j, n, best_filter, flip, simd, line_buffer);
             filter_type = best_filter;
          }
       }
@@ -1172,9 +1489,163 @@ STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int s
       filt[j*(x*n+1)] = (unsigned char) filter_type;
       STBIW_MEMMOVE(filt+j*(x*n+1)+1, line_buffer, x*n);
    }
+}
+
+#ifndef STBIW_ZLIB_COMPRESS
+typedef struct
+{
+   const unsigned char *pixels;
+   int stride_bytes, x, y, n, force_filter, flip, quality, bands;
+   unsigned char *filt;
+   unsigned char **zband;  // raw deflate per band; NULL if the band failed
+   unsigned int *adler;    // Adler-32 of each band's filtered bytes
+} stbiw__png_bands;
+
+static void stbiw__png_band_rows(int y, int bands, int band, int *y0, int *y1)
+{
+   int rows = y / bands, extra = y % bands;
+   *y0 = band * rows + (band < extra ? band : extra);
+   *y1 = *y0 + rows + (band < extra);
+}
+
+static void stbiw__png_band_task(void *arg, int band)
+{
+   stbiw__png_bands *b = (stbiw__png_bands *) arg;
+   int row = b->x * b->n + 1, y0, y1;
+   signed char *line_buffer = (signed char *) STBIW_MALLOC(b->x * b->n);
+   if (!line_buffer) return;
+   stbiw__png_band_rows(b->y, b->bands, band, &y0, &y1);
+   stbiw__png_filter_rows(b->pixels, b->stride_bytes, b->x, b->y, b->n, b->force_filter, b->flip, y0, y1, b->filt, line_buffer);
    STBIW_FREE(line_buffer);
-   zlib = stbi_zlib_compress(filt, y*( x*n+1), &zlen, stbi_write_png_compression_level);
-   STBIW_FREE(filt);
+   if (stbiw__zlib_deflate_band(&b->zband[band], b->filt + y0*row, (y1-y0)*row, b->quality, band == b->bands-1))
+      b->adler[band] = stbiw__adler32(b->filt + y0*row, (y1-y0)*row);
+}
+
+// Filter and deflate the image as independent row bands joined into one zlib stream
+static unsigned char *stbiw__png_deflate_bands(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int force_filter, int flip, const stbi_write_png_options *options, int bands, int *out_len)
+{
+   stbiw__png_bands b;
+   unsigned char *out = NULL;
+   unsigned int adler = 1;
+   int i, ok = 1, row = x*n+1;
+
+   b.pixels = pixels; b.stride_bytes = stride_bytes; b.x = x; b.y = y; b.n = n;
+   b.force_filter = force_filter; b.flip = flip; b.quality = options->compression_level; b.bands = bands;
+   b.filt = (unsigned char *) STBIW_MALLOC(row * y);
+   b.zband = (unsigned char **) STBIW_MALLOC(bands * sizeof(unsigned char *));
+   b.adler = (unsigned int *) STBIW_MALLOC(bands * sizeof(unsigned int));
+   if (!b.filt || !b.zband || !b.adler) {
+      if (b.filt) STBIW_FREE(b.filt);
+      if (b.zband) STBIW_FREE(b.zband);
+      if (b.adler) STBIW_FREE(b.adler);
+      return NULL;
+   }
+   for (i = 0; i < bands; ++i)
+      b.zband[i] = NULL;
+
+   if (options->parallel_for)
+      options->parallel_for(options->parallel_context, bands, stbiw__png_band_task, &b);
+   else
+      for (i = 0; i < bands; ++i)
+         stbiw__png_band_task(&b, i);
+
+   stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
+   stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
+   for (i = 0; i < bands; ++i) {
+      int y0, y1, len = stbiw__sbcount(b.zband[i]);
+      if (!b.zband[i]) {
+         ok = 0;
+         continue;
+      }
+      if (ok) {
+         stbiw__sbmaybegrow(out, len);
+         memcpy(out+stbiw__sbn(out), b.zband[i], len);
+         stbiw__sbn(out) += len;
+         stbiw__png_band_rows(y, bands, i, &y0, &y1);
+         adler = i ? stbiw__adler32_combine(adler, b.adler[i], (y1-y0)*row) : b.adler[i];
+      }
+      (void) stbiw__sbfree(b.zband[i]);
+   }
+   STBIW_FREE(b.filt);
+   STBIW_FREE(b.zband);
+   STBIW_FREE(b.adler);
+   if (!ok) {
+      (void) stbiw__sbfree(out);
+      return NULL;
+   }
+   return stbiw__zlib_finish(out, adler, out_len);
+}
+#endif // STBIW_ZLIB_COMPRESS
+
+STBIWDEF void stbi_write_png_default_options(stbi_write_png_options *options)
+{
+   options->compression_level = 8;
+   options->force_filter = -1;
+   options->flip_vertically = 0;
+   options->bands = 1;
+   options->parallel_for = NULL;
+   options->parallel_context = NULL;
+}
+
+// the global settings, for the original non-reentrant entry points
+static stbi_write_png_options stbiw__png_global_options(void)
+{
+   stbi_write_png_options options;
+   options.compression_level = stbi_write_png_compression_level;
+   options.force_filter = stbi_write_force_png_filter;
+   options.flip_vertically = stbi__flip_vertically_on_write;
+   options.bands = 1;
+   options.parallel_for = NULL;
+   options.parallel_context = NULL;
+   return options;
+}
+
+STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
+{
+   stbi_write_png_options options = stbiw__png_global_options();
+   return stbi_write_png_to_mem_ex(pixels, stride_bytes, x, y, n, out_len, &options);
+}
+
+STBIWDEF unsigned char *stbi_write_png_to_mem_ex(const unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len, const stbi_write_png_options *options)
+{
+   stbi_write_png_options defaults;
+   int force_filter, flip, bands;
+   int ctype[5] = { -1, 0, 4, 2, 6 };
+   unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
+   unsigned char *out,*o, *filt, *zlib = NULL;
+   signed char *line_buffer;
+   int zlen;
+
+   if (!options) {
+      stbi_write_png_default_options(&defaults);
+      options = &defaults;
+   }
+   force_filter = options->force_filter;
+   flip = options->flip_vertically;
+   bands = options->bands < y ? options->bands : y;
+#ifdef STBIW_ZLIB_COMPRESS
+   bands = 1;  // a user-provided compressor cannot be split into bands
+#endif
+
+   if (stride_bytes == 0)
+      stride_bytes = x * n;
+
+   if (force_filter >= 5) {
+      force_filter = -1;
+   }
+
+   if (bands > 1) {
+#ifndef STBIW_ZLIB_COMPRESS
+      zlib = stbiw__png_deflate_bands(pixels, stride_bytes, x, y, n, force_filter, flip, options, bands, &zlen);
+#endif
+   } else {
+      filt = (unsigned char *) STBIW_MALLOC((x*n+1) * y); if (!filt) return 0;
+      line_buffer = (signed char *) STBIW_MALLOC(x * n); if (!line_buffer) { STBIW_FREE(filt); return 0; }
+      stbiw__png_filter_rows(pixels, stride_bytes, x, y, n, force_filter, flip, 0, y, filt, line_buffer);
+      STBIW_FREE(line_buffer);
+      zlib = stbi_zlib_compress(filt, y*( x*n+1), &zlen, options->compression_level);
+      STBIW_FREE(filt);
+   }
    if (!zlib) return 0;
 
    // each tag requires 12 bytes of overhead
@@ -1213,10 +1684,16 @@ STBIWDEF unsigned char *stbi_write_png_to_mem(const unsigned char *pixels, int s
 
 #ifndef STBI_WRITE_NO_STDIO
 STBIWDEF int stbi_write_png(char const *filename, int x, int y, int comp, const void *data, int stride_bytes)
+{
+   stbi_write_png_options options = stbiw__png_global_options();
+   return stbi_write_png_ex(filename, x, y, comp, data, stride_bytes, &options);
+}
+
+STBIWDEF int stbi_write_png_ex(char const *filename, int x, int y, int comp, const void *data, int stride_bytes, const stbi_write_png_options *options)
 {
    FILE *f;
    int len;
-   unsigned char *png = stbi_write_png_to_mem((const unsigned char *) data, stride_bytes, x, y, comp, &len);
+   unsigned char *png = stbi_write_png_to_mem_ex((const unsigned char *) data, stride_bytes, x, y, comp, &len, options);
    if (png == NULL) return 0;
 
    f = stbiw__fopen(filename, "wb");
@@ -1229,9 +1706,15 @@ STBIWDEF int stbi_write_png(char const *filename, int x, int y, int comp, const
 #endif
 
 STBIWDEF int stbi_write_png_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, int stride_bytes)
+{
+   stbi_write_png_options options = stbiw__png_global_options();
+   return stbi_write_png_to_func_ex(func, context, x, y, comp, data, stride_bytes, &options);
+}
+
+STBIWDEF int stbi_write_png_to_func_ex(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, int stride_bytes, const stbi_write_png_options *options)
 {
    int len;
-   unsigned char *png = stbi_write_png_to_mem((const unsigned char *) data, stride_bytes, x, y, comp, &len);
+   unsigned char *png = stbi_write_png_to_mem_ex((const unsigned char *) data, stride_bytes, x, y, comp, &len, options);
    if (png == NULL) return 0;
    func(context, png, len);
    STBIW_FREE(png);